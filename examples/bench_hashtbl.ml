@@ -0,0 +1,48 @@
+open Iconv;;
+
+(* Look up converters in Hashtbl, which requires SUPPORT_COMPARISON. *)
+
+let encodings = [
+	"ASCII"; "UTF-8"; "UTF-16BE"; "UTF-16LE"; "UTF-32BE"; "UTF-32LE";
+	"ISO-8859-1"; "ISO-8859-2"; "ISO-8859-5"; "ISO-8859-15"; "CP1250";
+	"CP1251"; "CP1252"; "KOI8-R"; "SHIFT_JIS"; "EUC-JP"; "ISO-2022-JP";
+	"EUC-KR"; "GBK"; "BIG5"
+];;
+
+let open_pairs () = (
+	List.concat_map (fun tocode ->
+		List.filter_map (fun fromcode ->
+			if tocode = fromcode then None
+			else
+				match iconv_open ~tocode ~fromcode with
+				| exception Failure _ -> None
+				| c -> Some c
+		) encodings
+	) encodings
+	|> Array.of_list
+);;
+
+let keys = open_pairs ();;
+let n = Array.length keys;;
+
+let table = Hashtbl.create n;;
+Array.iteri (fun i c -> Hashtbl.replace table c i) keys;;
+
+(* look up with other converters equal to the keys *)
+let queries = open_pairs ();;
+
+let distinct_hashes =
+	Array.to_list keys |> List.map Hashtbl.hash |> List.sort_uniq compare
+	|> List.length;;
+
+Printf.printf "%d pairs\t%d distinct hashes\n%!" n distinct_hashes;;
+
+let r =
+	Lib_bench.measure (fun () ->
+		Array.iteri (fun i c ->
+			if Hashtbl.find table c <> i then assert false
+		) queries
+	);;
+
+Printf.printf "Hashtbl.find\t%.0f ns/lookup\n%!"
+	(r.Lib_bench.time *. 1e9 /. float_of_int (r.Lib_bench.count * n));;
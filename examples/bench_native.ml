@@ -0,0 +1,39 @@
+open Iconv;;
+
+(* Compare the built-in conversions with iconv opened with the suffix "//". *)
+
+let bench (name: string) ~(tocode: string) ~(fromcode: string) (s: string) = (
+	List.iter (fun (suffix, kind) ->
+		match iconv_open ~tocode:(tocode ^ suffix) ~fromcode:(fromcode ^ suffix) with
+		| exception Failure _ ->
+			()
+		| c ->
+			let r = Lib_bench.measure (fun () -> ignore (iconv_string c s)) in
+			Lib_bench.report (name ^ ", " ^ kind) ~bytes:(String.length s) r
+	) ["", "built-in"; "//", "iconv"]
+);;
+
+let repeat (n: int) (s: string) = (
+	let b = Buffer.create (String.length s * n) in
+	for _ = 1 to n do Buffer.add_string b s done;
+	Buffer.contents b
+);;
+
+let ascii = repeat 65536 "0123456789abcdef";; (* 1MB *)
+let latin1 = repeat 65536 "Caf\xc3\xa9 au lait.";; (* 1MB *)
+let cp1252 = repeat 65536 "Caf\xe9 au lait.";; (* 1MB *)
+let japanese = repeat 21846 "あいうえおかきくけこ日本語の文章";; (* 1MB *)
+
+bench "ascii utf-8 -> ascii" ~tocode:"ASCII" ~fromcode:"UTF-8" ascii;;
+bench "ascii utf-8 -> utf-16le" ~tocode:"UTF-16LE" ~fromcode:"UTF-8" ascii;;
+bench "latin1 utf-8 -> latin1" ~tocode:"ISO-8859-1" ~fromcode:"UTF-8" latin1;;
+bench "cp1252 -> utf-8" ~tocode:"UTF-8" ~fromcode:"CP1252" cp1252;;
+bench "cp1252 -> latin1" ~tocode:"ISO-8859-1" ~fromcode:"CP1252" cp1252;;
+bench "japanese utf-8 -> utf-16le" ~tocode:"UTF-16LE" ~fromcode:"UTF-8"
+	japanese;;
+
+let japanese_utf16 =
+	iconv_string (iconv_open ~tocode:"UTF-16LE" ~fromcode:"UTF-8") japanese;;
+
+bench "japanese utf-16le -> utf-8" ~tocode:"UTF-8" ~fromcode:"UTF-16LE"
+	japanese_utf16;;
@@ -0,0 +1,97 @@
+open Iconv;;
+
+let bench_writer (name: string) (w: Out_iconv.t) (s: string) = (
+	let r =
+		Lib_bench.measure (fun () ->
+			(* 4KB chunks *)
+			let rec loop pos = (
+				let len = min 4096 (String.length s - pos) in
+				if len > 0 then (
+					Out_iconv.output_substring w s pos len;
+					loop (pos + len)
+				)
+			) in
+			loop 0;
+			Out_iconv.end_out w;
+			Out_iconv.reset_out w
+		)
+	in
+	Lib_bench.report name ~bytes:(String.length s) r
+);;
+
+let bench (name: string) ?buffer_size ?double_buffered ~(tocode: string)
+	~(fromcode: string) (s: string) =
+(
+	let sink _ _ _ = () in
+	let w =
+		Out_iconv.open_out ?buffer_size ?double_buffered ~tocode ~fromcode sink
+	in
+	bench_writer name w s
+);;
+
+let japanese = (* 1MB *)
+	String.concat ""
+		(List.init 21846 (fun _ -> "あいうえおかきくけこ日本語の文章"));;
+
+bench "utf-8 -> sjis, 240 bytes" ~buffer_size:240 ~tocode:"SHIFT_JIS"
+	~fromcode:"UTF-8" japanese;;
+bench "utf-8 -> sjis, 64KB" ~tocode:"SHIFT_JIS" ~fromcode:"UTF-8" japanese;;
+bench "utf-8 -> sjis, 64KB, double-buffered" ~double_buffered:true
+	~tocode:"SHIFT_JIS" ~fromcode:"UTF-8" japanese;;
+
+(* specialized destinations against the callbacks *)
+
+let b = Buffer.create (String.length japanese) in
+let w =
+	Out_iconv.open_out ~tocode:"SHIFT_JIS" ~fromcode:"UTF-8"
+		(Buffer.add_substring b)
+in
+bench_writer "utf-8 -> sjis, Buffer.add_substring" w japanese;
+Buffer.clear b;
+let w = Out_iconv.open_out_buffer ~tocode:"SHIFT_JIS" ~fromcode:"UTF-8" b in
+bench_writer "utf-8 -> sjis, open_out_buffer" w japanese;;
+
+let oc = open_out_bin Filename.null in
+let w =
+	Out_iconv.open_out ~tocode:"SHIFT_JIS" ~fromcode:"UTF-8"
+		(output_substring oc)
+in
+bench_writer "utf-8 -> sjis, output_substring" w japanese;
+let w = Out_iconv.open_out_channel ~tocode:"SHIFT_JIS" ~fromcode:"UTF-8" oc in
+bench_writer "utf-8 -> sjis, open_out_channel" w japanese;
+close_out oc;;
+
+(* encode from code points *)
+
+let chars = (* 1MB in UTF-8 *)
+	let d = iconv_open_decode ~fromcode:"UTF-8" in
+	let chars, _, _ = decode_substring d japanese 0 (String.length japanese) in
+	chars;;
+
+let () =
+	let sink _ _ _ = () in
+	let e = iconv_open_encode ~tocode:"SHIFT_JIS" sink in
+	let r =
+		Lib_bench.measure (fun () ->
+			Array.iter (encode_uchar e) chars;
+			encode_end e
+		)
+	in
+	Lib_bench.report "encode_uchar -> sjis" ~bytes:(String.length japanese) r;
+	let r =
+		Lib_bench.measure (fun () ->
+			encode_uchars e chars;
+			encode_end e
+		)
+	in
+	Lib_bench.report "encode_uchars -> sjis" ~bytes:(String.length japanese) r;
+	let c = iconv_open ~tocode:"SHIFT_JIS" ~fromcode:"UTF-8" in
+	let r =
+		Lib_bench.measure (fun () ->
+			let b = Buffer.create 4096 in
+			Array.iter (Buffer.add_utf_8_uchar b) chars;
+			ignore (iconv_string c (Buffer.contents b))
+		)
+	in
+	Lib_bench.report "utf-8 Buffer and iconv_string -> sjis"
+		~bytes:(String.length japanese) r;;
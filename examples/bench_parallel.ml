@@ -0,0 +1,39 @@
+open Iconv;;
+
+let repeat (n: int) (s: string) = (
+	let b = Buffer.create (String.length s * n) in
+	for _ = 1 to n do Buffer.add_string b s done;
+	Buffer.contents b
+);;
+
+let japanese = repeat (16 * 21846) "あいうえおかきくけこ日本語の文章";; (* 16MB *)
+let count = 4;;
+
+let run ~(tocode: string) ~(fromcode: string) (s: string) (workers: int) = (
+	let c = iconv_open ~tocode ~fromcode in
+	let start_time = Unix.gettimeofday () in
+	for _ = 1 to count do
+		ignore (Parallel.convert ~workers c s)
+	done;
+	let time = Unix.gettimeofday () -. start_time in
+	let mb = float_of_int (String.length s * count) /. 1048576. in
+	mb /. time
+);;
+
+let bench (name: string) ~(tocode: string) ~(fromcode: string) (s: string) = (
+	let base = run ~tocode ~fromcode s 1 in
+	Printf.printf "%s\tworkers\t1\t%.2f MB/s\n%!" name base;
+	List.iter (fun workers ->
+		let r = run ~tocode ~fromcode s workers in
+		Printf.printf "%s\tworkers\t%d\t%.2f MB/s\tx%.2f\n%!" name workers r
+			(r /. base)
+	) [2; 4; 8; 16]
+);;
+
+bench "utf-8 -> sjis" ~tocode:"SHIFT_JIS" ~fromcode:"UTF-8" japanese;;
+bench "utf-8 -> utf-16le" ~tocode:"UTF-16LE" ~fromcode:"UTF-8" japanese;;
+
+let sjis =
+	iconv_string (iconv_open ~tocode:"SHIFT_JIS" ~fromcode:"UTF-8") japanese;;
+
+bench "sjis -> utf-8" ~tocode:"UTF-8" ~fromcode:"SHIFT_JIS" sjis;;
@@ -0,0 +1,186 @@
+open Iconv;;
+
+(* Measure every conversion path with generated corpora in several sizes.
+   Run with BENCH_OUTPUT=file to get the results as TSV. *)
+
+let make_corpus (unit: string) (size: int) = (
+	let n = max 1 (size / String.length unit) in
+	let b = Buffer.create (String.length unit * n) in
+	for _ = 1 to n do Buffer.add_string b unit done;
+	Buffer.contents b
+);;
+
+let corpora = [
+	"ascii", "0123456789abcdef";
+	"mostly-ascii", "Hello, world! 123 abcdefghijklmnopqrstuvwxyz \xe4\xb8\x96\xe7\x95\x8c\n";
+	"cjk", "あいうえおかきくけこ日本語の文章";
+	"invalid", "ab\xffあ\xe3\x81c\xfe"
+];;
+
+let sizes = [
+	"64B", 64;
+	"4KB", 4096;
+	"1MB", 1048576
+];;
+
+let pairs = [
+	"utf-8 -> utf-16le", "UTF-16LE", "UTF-8";
+	"utf-8 -> sjis", "SHIFT_JIS", "UTF-8";
+	"utf-8 -> euc-jp", "EUC-JP", "UTF-8"
+];;
+
+let out_capacity = 0x10000;;
+
+(* iconv stops at an illegal sequence, so it is skipped by 1 byte *)
+let run_iconv (cd: iconv_t) (s: string) = (
+	let fields = {
+		inbuf = s;
+		inbuf_offset = 0;
+		inbytesleft = String.length s;
+		outbuf = Bytes.create out_capacity;
+		outbuf_offset = 0;
+		outbytesleft = out_capacity
+	} in
+	let rec loop () = (
+		match iconv cd fields true with
+		| `ok ->
+			()
+		| `overflow ->
+			fields.outbuf_offset <- 0;
+			fields.outbytesleft <- out_capacity;
+			loop ()
+		| `illegal_sequence ->
+			fields.inbuf_offset <- fields.inbuf_offset + 1;
+			fields.inbytesleft <- fields.inbytesleft - 1;
+			loop ()
+	) in
+	loop ();
+	iconv_reset cd
+);;
+
+let run_iconv_substitute (cd: iconv_t) (s: string) = (
+	let fields = {
+		inbuf = s;
+		inbuf_offset = 0;
+		inbytesleft = String.length s;
+		outbuf = Bytes.create out_capacity;
+		outbuf_offset = 0;
+		outbytesleft = out_capacity
+	} in
+	let rec loop () = (
+		match iconv_substitute cd fields true with
+		| `ok ->
+			()
+		| `overflow ->
+			fields.outbuf_offset <- 0;
+			fields.outbytesleft <- out_capacity;
+			loop ()
+	) in
+	loop ();
+	iconv_reset cd
+);;
+
+let bench_pair (label: string) ~(tocode: string) ~(fromcode: string)
+	(s: string) =
+(
+	let bytes = String.length s in
+	let cd = iconv_open ~tocode ~fromcode in
+	let run path f = (
+		let r = Lib_bench.measure f in
+		Lib_bench.report (path ^ ", " ^ label) ~bytes r
+	) in
+	run "iconv_string" (fun () -> ignore (iconv_string cd s));
+	run "iconv_substring" (fun () -> ignore (iconv_substring cd s 0 bytes));
+	run "iconv" (fun () -> run_iconv cd s);
+	run "iconv_substitute" (fun () -> run_iconv_substitute cd s);
+	let w =
+		Out_iconv.open_out ~tocode ~fromcode (fun _ _ _ -> ())
+	in
+	run "Out_iconv" (fun () ->
+		Out_iconv.output_string w s;
+		Out_iconv.end_out w;
+		Out_iconv.reset_out w
+	)
+);;
+
+(* decoding stops at an illegal sequence, so it is skipped by 1 byte *)
+let bench_decode (label: string) ~(fromcode: string) (s: string) = (
+	let bytes = String.length s in
+	let d = iconv_open_decode ~fromcode in
+	let r =
+		Lib_bench.measure (fun () ->
+			let rec loop i = (
+				if i < bytes then
+					iconv_decode d String.get (fun _ i -> i + 1)
+						(fun s i -> i >= String.length s)
+						(fun _ _ i _ -> loop i)
+						~fail:(fun _ start_pos end_pos _ ->
+							loop (if end_pos > start_pos then end_pos else start_pos + 1))
+						s i
+			) in
+			loop 0
+		)
+	in
+	Lib_bench.report ("iconv_decode, " ^ label) ~bytes r;
+	let r =
+		Lib_bench.measure (fun () ->
+			let rec loop i = (
+				if i < bytes then (
+					let _, offsets, _ = decode_substring d s i (bytes - i) in
+					let end_pos = offsets.(Array.length offsets - 1) in
+					loop (if end_pos < bytes then end_pos + 1 else end_pos)
+				)
+			) in
+			loop 0
+		)
+	in
+	Lib_bench.report ("decode_substring, " ^ label) ~bytes r
+);;
+
+List.iter (fun (corpus_name, unit) ->
+	List.iter (fun (size_name, size) ->
+		let s = make_corpus unit size in
+		let label = corpus_name ^ " " ^ size_name in
+		List.iter (fun (pair_name, tocode, fromcode) ->
+			bench_pair (label ^ ", " ^ pair_name) ~tocode ~fromcode s
+		) pairs;
+		bench_decode (label ^ ", utf-8") ~fromcode:"UTF-8" s;
+		let r = Lib_bench.measure (fun () -> ignore (detect s)) in
+		Lib_bench.report ("detect, " ^ label) ~bytes:(String.length s) r
+	) sizes
+) corpora;;
+
+(* converting and splitting into lines *)
+
+let log =
+	let c = iconv_open ~tocode:"SHIFT_JIS" ~fromcode:"UTF-8" in
+	iconv_string c (make_corpus "2024-01-01 00:00:00 ログの行です。\r\n" 1048576);;
+
+let source_of_string (s: string) = (
+	let pos = ref 0 in
+	fun buf offset len ->
+	let len = min len (String.length s - !pos) in
+	Bytes.blit_string s !pos buf offset len;
+	pos := !pos + len;
+	len
+);;
+
+let bytes = String.length log in
+let cd = iconv_open ~tocode:"UTF-8" ~fromcode:"SHIFT_JIS" in
+let r =
+	Lib_bench.measure (fun () ->
+		let lines = String.split_on_char '\n' (iconv_string cd log) in
+		List.iter (fun line -> ignore (String.length line)) lines
+	)
+in
+Lib_bench.report "iconv_string and split_on_char, sjis log 1MB" ~bytes r;
+let r =
+	Lib_bench.measure (fun () ->
+		let ic =
+			In_iconv.open_in ~tocode:"UTF-8" ~fromcode:"SHIFT_JIS"
+				(source_of_string log)
+		in
+		In_iconv.iter_lines ic (fun _ _ _ -> ())
+	)
+in
+Lib_bench.report "In_iconv.iter_lines, sjis log 1MB" ~bytes r;;
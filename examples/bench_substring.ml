@@ -0,0 +1,62 @@
+open Iconv;;
+
+let repeat (n: int) (s: string) = (
+	let b = Buffer.create (String.length s * n) in
+	for _ = 1 to n do Buffer.add_string b s done;
+	Buffer.contents b
+);;
+
+let bench (name: string) ~(tocode: string) ~(fromcode: string) (s: string) = (
+	let c = iconv_open ~tocode ~fromcode in
+	let r = Lib_bench.measure (fun () -> ignore (iconv_string c s)) in
+	Lib_bench.report name ~bytes:(String.length s) r
+);;
+
+let ascii = repeat 65536 "0123456789abcdef";; (* 1MB *)
+let japanese = repeat 21846 "あいうえおかきくけこ日本語の文章";; (* 1MB *)
+
+bench "ascii utf-8 -> utf-16be" ~tocode:"UTF-16BE" ~fromcode:"UTF-8" ascii;;
+bench "ascii utf-8 -> latin1" ~tocode:"ISO-8859-1" ~fromcode:"UTF-8" ascii;;
+bench "japanese utf-8 -> sjis" ~tocode:"SHIFT_JIS" ~fromcode:"UTF-8" japanese;;
+bench "japanese utf-8 -> utf-32be" ~tocode:"UTF-32BE" ~fromcode:"UTF-8"
+	japanese;;
+
+let japanese_utf16 =
+	iconv_string (iconv_open ~tocode:"UTF-16BE" ~fromcode:"UTF-8") japanese;;
+
+(* the estimated length is smaller than the result *)
+bench "japanese utf-16be -> utf-8" ~tocode:"UTF-8" ~fromcode:"UTF-16BE"
+	japanese_utf16;;
+
+(* short fields *)
+
+let fields = Array.init 65536 (fun i -> Printf.sprintf "%d,Caf\xc3\xa9" i);;
+let fields_bytes = Array.fold_left (fun n s -> n + String.length s) 0 fields;;
+
+let bench_fields (name: string) ~(tocode: string) ~(fromcode: string) = (
+	let c = iconv_open ~tocode ~fromcode in
+	let r = Lib_bench.measure (fun () -> ignore (Array.map (iconv_string c) fields)) in
+	Lib_bench.report (name ^ ", iconv_string") ~bytes:fields_bytes r;
+	let r = Lib_bench.measure (fun () -> ignore (iconv_strings c fields)) in
+	Lib_bench.report (name ^ ", iconv_strings") ~bytes:fields_bytes r
+);;
+
+bench_fields "fields utf-8 -> sjis" ~tocode:"SHIFT_JIS" ~fromcode:"UTF-8";;
+bench_fields "fields utf-8 -> latin1" ~tocode:"ISO-8859-1" ~fromcode:"UTF-8";;
+
+(* without the output *)
+
+let bench_measure (name: string) ~(tocode: string) ~(fromcode: string)
+	(s: string) =
+(
+	let c = iconv_open ~tocode ~fromcode in
+	let r = Lib_bench.measure (fun () -> ignore (validate c s)) in
+	Lib_bench.report (name ^ ", validate") ~bytes:(String.length s) r;
+	let r = Lib_bench.measure (fun () -> ignore (converted_length c s)) in
+	Lib_bench.report (name ^ ", converted_length") ~bytes:(String.length s) r
+);;
+
+bench_measure "japanese utf-8 -> utf-16be" ~tocode:"UTF-16BE" ~fromcode:"UTF-8"
+	japanese;;
+bench_measure "japanese utf-8 -> sjis" ~tocode:"SHIFT_JIS" ~fromcode:"UTF-8"
+	japanese;;
@@ -0,0 +1,42 @@
+open Iconv;;
+
+let repeat (n: int) (s: string) = (
+	let b = Buffer.create (String.length s * n) in
+	for _ = 1 to n do Buffer.add_string b s done;
+	Buffer.contents b
+);;
+
+let japanese = repeat (4 * 21846) "あいうえおかきくけこ日本語の文章";; (* 4MB *)
+let count = 16;;
+
+let run (threads: int) = (
+	let start_time = Unix.gettimeofday () in
+	let ts =
+		List.init threads (fun _ ->
+			Thread.create (fun () ->
+				let c = iconv_open ~tocode:"SHIFT_JIS" ~fromcode:"UTF-8" in
+				for _ = 1 to count do
+					ignore (iconv_string c japanese)
+				done
+			) ()
+		)
+	in
+	List.iter Thread.join ts;
+	let time = Unix.gettimeofday () -. start_time in
+	let mb =
+		float_of_int (String.length japanese * count * threads) /. 1048576.
+	in
+	mb /. time
+);;
+
+let base = run 1;;
+Printf.printf "threads\t1\t%.2f MB/s\n%!" base;;
+List.iter (fun threads ->
+	let r = run threads in
+	Printf.printf "threads\t%d\t%.2f MB/s\tx%.2f\n%!" threads r (r /. base)
+) [2; 4; 8];;
+
+(* the same without releasing the runtime lock *)
+set_blocking_section_threshold max_int;;
+let r = run 4;;
+Printf.printf "locked threads\t4\t%.2f MB/s\tx%.2f\n%!" r (r /. base);;
@@ -0,0 +1,58 @@
+let min_time = 0.5;;
+
+type result = {
+	count: int;
+	time: float;
+	minor_words: float;
+	major_words: float
+};;
+
+let measure (f: unit -> unit) = (
+	f (); (* warm up *)
+	Gc.full_major ();
+	let start_stat = Gc.quick_stat () in
+	let start_time = Sys.time () in
+	let rec loop count = (
+		f ();
+		let count = count + 1 in
+		let time = Sys.time () -. start_time in
+		if time < min_time then loop count
+		else (
+			let stat = Gc.quick_stat () in
+			{
+				count;
+				time;
+				minor_words = stat.minor_words -. start_stat.minor_words;
+				major_words = stat.major_words -. start_stat.major_words
+			}
+		)
+	) in
+	loop 0
+);;
+
+(* The results are also appended to the file of BENCH_OUTPUT as TSV:
+   program, name, bytes, MB/s, ns/call, minor words/MB, major words/MB *)
+let output = (
+	match Sys.getenv_opt "BENCH_OUTPUT" with
+	| Some path when path <> "" ->
+		Some (open_out_gen [Open_wronly; Open_append; Open_creat] 0o644 path)
+	| _ -> None
+);;
+
+let program = Filename.remove_extension (Filename.basename Sys.executable_name);;
+
+let report (name: string) ~(bytes: int) (r: result) = (
+	let mb = float_of_int bytes *. float_of_int r.count /. 1048576. in
+	let mb_per_s = mb /. r.time in
+	let ns_per_call = r.time *. 1e9 /. float_of_int r.count in
+	let minor_words_per_mb = r.minor_words /. mb in
+	let major_words_per_mb = r.major_words /. mb in
+	Printf.printf "%s\t%.2f MB/s\t%.0f ns/call\t%.1f minor words/MB\t%.1f major words/MB\n%!"
+		name mb_per_s ns_per_call minor_words_per_mb major_words_per_mb;
+	match output with
+	| Some oc ->
+		Printf.fprintf oc "%s\t%s\t%d\t%.2f\t%.0f\t%.1f\t%.1f\n%!" program name bytes
+			mb_per_s ns_per_call minor_words_per_mb major_words_per_mb
+	| None ->
+		()
+);;
@@ -23,6 +23,42 @@ let hash_x = Hashtbl.hash x |> f __LINE__ "%.8x" in
 let hash_y = Hashtbl.hash y |> f __LINE__ "%.8x" in
 assert (hash_x <> hash_y);;
 
+(* names of the same lengths *)
+let x = Iconv.iconv_open ~tocode:"UTF-8" ~fromcode:"SJIS" in
+let y = Iconv.iconv_open ~tocode:"EUC-JP" ~fromcode:"ASCII" in
+let hash_x = Hashtbl.hash x |> f __LINE__ "%.8x" in
+let hash_y = Hashtbl.hash y |> f __LINE__ "%.8x" in
+assert (hash_x <> hash_y);;
+
+(* the default substitute is different from an explicit one *)
+let x = Iconv.iconv_open ~tocode:"LATIN1" ~fromcode:"UTF-8" in
+let y = Iconv.iconv_open ~tocode:"LATIN1" ~fromcode:"UTF-8" in
+let default = Iconv.substitute x |> f __LINE__ "%S" in
+(* probing does not change it *)
+assert (x = y);
+assert (Hashtbl.hash x = Hashtbl.hash y);
+Iconv.set_substitute x default;
+assert (x <> y);
+Iconv.set_substitute y default;
+assert (x = y);
+assert (Hashtbl.hash x = Hashtbl.hash y);
+Iconv.set_substitute y "*";
+assert (x <> y);
+assert (compare x y = - (compare y x));;
+
+(* the names are normalized *)
+let x = Iconv.iconv_open ~tocode:"UTF-16BE" ~fromcode:"UTF-8" in
+let y = Iconv.iconv_open ~tocode:"utf-16be" ~fromcode:"utf-8" in
+assert (x = y);
+assert (Hashtbl.hash x = Hashtbl.hash y);;
+
+(* closed converters can be compared *)
+let x = Iconv.iconv_open ~tocode:"LATIN1" ~fromcode:"UTF-8" in
+let y = Iconv.iconv_open ~tocode:"LATIN1" ~fromcode:"UTF-8" in
+Iconv.close x;
+assert (x = y);
+assert (Hashtbl.hash x = Hashtbl.hash y);;
+
 (* report *)
 
 prerr_endline "ok";;
@@ -30,6 +30,144 @@ let s = "Aあ" in
 let x = iconv_string c s |> f __LINE__ "%S" in
 assert (x = "\x41\x1B\x24\x42\x24\x22\x1B\x28\x42");;
 
+(* the output buffer is enlarged over the estimated length *)
+
+let s = String.concat "" (List.init 10000 (fun _ -> "あいうえお\xff")) in
+let c = iconv_open ~tocode:"UTF-16BE" ~fromcode:"UTF-8" in
+let x = iconv_string c s in
+assert (String.length x |> f __LINE__ "%d" = 10000 * 6 * 2);
+let c = iconv_open ~tocode:"UTF-8" ~fromcode:"UTF-16BE" in
+let y = iconv_string c x in
+assert (
+	y = String.concat "" (List.init 10000 (fun _ -> "あいうえお?"))
+);
+(* without the runtime lock *)
+let threshold = blocking_section_threshold () in
+set_blocking_section_threshold 1;
+let z = iconv_string c x in
+assert (z = y);
+let fields = {
+	inbuf = "\x30\x42\xdc\x00\x30\x44";
+	inbuf_offset = 0;
+	inbytesleft = 6;
+	outbuf = Bytes.create 9;
+	outbuf_offset = 0;
+	outbytesleft = 9
+}
+in
+assert (iconv_substitute c fields true = `ok);
+assert (fields.inbytesleft |> f __LINE__ "%d" = 0);
+assert (fields.outbytesleft |> f __LINE__ "%d" = 2);
+assert (Bytes.sub_string fields.outbuf 0 7 |> f __LINE__ "%S" = "あ?い");
+set_blocking_section_threshold threshold;;
+
+(* batch *)
+
+let c = iconv_open ~tocode:"ISO-2022-JP" ~fromcode:"UTF-8" in
+let a = [| "Aあ"; ""; "い\xffB"; "う" |] in
+let x = iconv_strings c a in
+assert (Array.length x |> f __LINE__ "%d" = 4);
+(* each string ends in the initial shift state *)
+assert (x.(0) |> f __LINE__ "%S" = "\x41\x1B\x24\x42\x24\x22\x1B\x28\x42");
+assert (x.(1) |> f __LINE__ "%S" = "");
+assert (x.(2) |> f __LINE__ "%S" = "\x1B\x24\x42\x24\x24\x1B\x28\x42?B");
+assert (x.(3) |> f __LINE__ "%S" = "\x1B\x24\x42\x24\x26\x1B\x28\x42");
+assert (x = Array.map (iconv_string c) a);
+assert (iconv_strings c [| |] = [| |]);
+let a = Array.init 10000 (fun i -> String.make (i mod 7) 'x' ^ "日本") in
+let c = iconv_open ~tocode:"UTF-16BE" ~fromcode:"UTF-8" in
+let expected = Array.map (iconv_string c) a in
+assert (iconv_strings c a = expected);
+(* without the runtime lock *)
+let threshold = blocking_section_threshold () in
+set_blocking_section_threshold 1;
+assert (iconv_strings c a = expected);
+set_blocking_section_threshold threshold;;
+
+(* substitution report *)
+
+let c = iconv_open ~tocode:"UTF-16BE" ~fromcode:"UTF-8" in
+let report = make_substitution_report 2 in
+let s = "xa\xffbあ\xff\xffc" in
+let x = iconv_substring ~report c s 1 (String.length s - 1) in
+assert (String.length x |> f __LINE__ "%d" = 14);
+assert (report.substitutions |> f __LINE__ "%d" = 3);
+assert (report.input_offsets = [| 2; 7 |]);
+assert (report.output_offsets = [| 2; 8 |]);
+(* accumulated *)
+ignore (iconv_string ~report c "\xff");
+assert (report.substitutions |> f __LINE__ "%d" = 4);
+let report = make_substitution_report 1 in
+let fields = {
+	inbuf = "xあ\xffい";
+	inbuf_offset = 1;
+	inbytesleft = 7;
+	outbuf = Bytes.create 8;
+	outbuf_offset = 2;
+	outbytesleft = 6
+}
+in
+assert (iconv_substitute ~report c fields true = `ok);
+assert (report.substitutions |> f __LINE__ "%d" = 1);
+assert (report.input_offsets.(0) |> f __LINE__ "%d" = 4);
+assert (report.output_offsets.(0) |> f __LINE__ "%d" = 4);
+(* without the runtime lock *)
+let threshold = blocking_section_threshold () in
+set_blocking_section_threshold 1;
+let report = make_substitution_report 2 in
+ignore (iconv_substring ~report c s 1 (String.length s - 1));
+assert (report.input_offsets = [| 2; 7 |]);
+assert (report.output_offsets = [| 2; 8 |]);
+set_blocking_section_threshold threshold;;
+
+(* validation *)
+
+let c = iconv_open ~tocode:"UTF-16LE" ~fromcode:"UTF-8" in
+assert (validate c "abc" = `ok);
+assert (validate c "" = `ok);
+assert (
+	match validate c "ab\xffc" with
+	| `illegal_sequence offset -> offset |> f __LINE__ "%d" = 2
+	| _ -> false
+);
+assert (
+	match validate c "あ\xe3\x81" with
+	| `truncated offset -> offset |> f __LINE__ "%d" = 3
+	| _ -> false
+);
+assert (
+	match validate_substring c "xab\xffc" 1 3 with
+	| `illegal_sequence offset -> offset |> f __LINE__ "%d" = 3
+	| _ -> false
+);
+let c = iconv_open ~tocode:"ASCII" ~fromcode:"UTF-8" in
+assert (
+	match validate c "Caf\xc3\xa9" with
+	| `illegal_sequence offset -> offset |> f __LINE__ "%d" = 3
+	| _ -> false
+);;
+
+let c = iconv_open ~tocode:"ISO-2022-JP" ~fromcode:"UTF-8" in
+List.iter (fun s ->
+	assert (
+		converted_length c s |> f __LINE__ "%d" = String.length (iconv_string c s)
+	)
+) [""; "A"; "Aあ"; "い\xffB"; String.concat "" (List.init 1000 (fun _ -> "あa"))];
+assert (converted_length_of_substring c "xAあ" 1 1 = 1);
+let s = String.concat "" (List.init 10000 (fun _ -> "あいうえお\xff")) in
+let c = iconv_open ~tocode:"UTF-16BE" ~fromcode:"UTF-8" in
+assert (converted_length c s |> f __LINE__ "%d" = 10000 * 6 * 2);
+(* without the runtime lock *)
+let threshold = blocking_section_threshold () in
+set_blocking_section_threshold 1;
+assert (converted_length c s |> f __LINE__ "%d" = 10000 * 6 * 2);
+assert (
+	match validate c s with
+	| `illegal_sequence offset -> offset |> f __LINE__ "%d" = 15
+	| _ -> false
+);
+set_blocking_section_threshold threshold;;
+
 (* decode *)
 
 let d = iconv_open_decode ~fromcode:"EUC-JP" in
@@ -194,6 +332,226 @@ let c: Uchar.t =
 in
 assert (Uchar.to_int c = 0x3042);;
 
+let d = iconv_open_decode ~fromcode:"EUC-JP" in
+set_unexist (fst (d :> iconv_t * iconv_decode_state)) `illegal_sequence;
+let chars, offsets, error = decode_substring d "xA\xa3\xc1$\xa3" 1 5 in
+assert (error = `truncated);
+assert (Array.length chars |> f __LINE__ "%d" = 3);
+assert (
+	Array.map Uchar.to_int chars = [| Char.code 'A'; 0xff21; Char.code '$' |]
+);
+assert (offsets = [| 1; 2; 4; 5 |]);
+let chars, offsets, error = decode_substring d "\xa3\xc1\xa3\x00" 0 4 in
+assert (error = `illegal_sequence);
+assert (Array.map Uchar.to_int chars = [| 0xff21 |]);
+assert (offsets = [| 0; 2 |]);
+let chars, offsets, error = decode_substring d "" 0 0 in
+assert (error = `ok);
+assert (chars = [| |]);
+assert (offsets = [| 0 |]);;
+
+(* encode *)
+
+let buf = Buffer.create 256 in
+let e = iconv_open_encode ~tocode:"ISO-2022-JP" (Buffer.add_substring buf) in
+encode_uchar e (Uchar.of_char 'A');
+encode_uchars e [| Uchar.of_int 0x3042; Uchar.of_int 0x3044 |];
+encode_flush e;
+assert (Buffer.contents buf |> f __LINE__ "%S" = "A\x1B$B$\"$$");
+encode_uchar e (Uchar.of_char 'B');
+encode_end e;
+assert (Buffer.contents buf |> f __LINE__ "%S" = "A\x1B$B$\"$$\x1B(BB");;
+
+(* substituted same as iconv_substitute *)
+let buf = Buffer.create 256 in
+let e = iconv_open_encode ~tocode:"ASCII" (Buffer.add_substring buf) in
+set_substitute (fst (e :> iconv_t * iconv_encode_state)) "*";
+encode_uchars e [| Uchar.of_char 'A'; Uchar.of_int 0x3042; Uchar.of_char 'B' |];
+encode_end e;
+assert (Buffer.contents buf |> f __LINE__ "%S" = "A*B");;
+
+(* a large input over the block *)
+let chars =
+	Array.init 10000 (fun i ->
+		if i mod 3 = 0 then Uchar.of_char 'A' else Uchar.of_int (0x3042 + i mod 64))
+in
+let utf8 = Buffer.create 30000 in
+Array.iter (Buffer.add_utf_8_uchar utf8) chars;
+let c = iconv_open ~tocode:"ISO-2022-JP" ~fromcode:"UTF-8" in
+let expected = iconv_string c (Buffer.contents utf8) in
+let buf = Buffer.create 30000 in
+let e = iconv_open_encode ~tocode:"ISO-2022-JP" (Buffer.add_substring buf) in
+encode_uchars e chars;
+encode_end e;
+assert (Buffer.contents buf = expected);
+let buf = Buffer.create 30000 in
+let e = iconv_open_encode ~tocode:"ISO-2022-JP" (Buffer.add_substring buf) in
+Array.iter (encode_uchar e) chars;
+encode_end e;
+assert (Buffer.contents buf = expected);;
+
+(* file *)
+
+let read_file name = (
+	let ic = open_in_bin name in
+	let s = really_input_string ic (in_channel_length ic) in
+	close_in ic;
+	s
+);;
+
+let write_file name s = (
+	let oc = open_out_bin name in
+	output_string oc s;
+	close_out oc
+);;
+
+(* sequences and the shift state over the blocks *)
+let s = String.concat "" (List.init 100000 (fun i -> "Aあい" ^ String.make (i mod 3) '\xff')) in
+let src = Filename.temp_file "test_conv" ".txt" in
+let dst = Filename.temp_file "test_conv" ".txt" in
+write_file src s;
+let c = iconv_open ~tocode:"ISO-2022-JP" ~fromcode:"UTF-8" in
+let expected = iconv_string c s in
+convert_file c ~src ~dst;
+assert (read_file dst = expected);
+(* the rest of the channel *)
+let ic = open_in_bin src in
+let oc = open_out_bin dst in
+assert (input_char ic |> f __LINE__ "%C" = 'A');
+output_string oc "A";
+convert_channel c ic oc;
+close_in ic;
+close_out oc;
+assert (read_file dst = "A" ^ iconv_substring c s 1 (String.length s - 1));
+(* Sys_error with the name of the failed file *)
+let has_prefix (prefix: string) (s: string) =
+	String.length s >= String.length prefix
+	&& String.sub s 0 (String.length prefix) = prefix
+in
+let src_dir = Filename.get_temp_dir_name () in
+assert (
+	match convert_file c ~src:src_dir ~dst with
+	| () -> false
+	| exception Sys_error message ->
+		has_prefix (src_dir ^ ": ") (f __LINE__ "%s" message)
+);
+assert (not (Sys.file_exists dst)); (* the partial destination is removed *)
+if Sys.file_exists "/dev/full" then (
+	assert (
+		match convert_file c ~src ~dst:"/dev/full" with
+		| () -> false
+		| exception Sys_error message ->
+			has_prefix "/dev/full: " (f __LINE__ "%s" message)
+	)
+);
+Sys.remove src;
+assert (
+	match convert_file c ~src ~dst with
+	| () -> false
+	| exception Sys_error _ -> true
+);;
+
+(* detect *)
+
+let first_detected s = (
+	match detect s with
+	| (name, _) :: _ -> name
+	| [] -> ""
+);;
+
+let s = "日本語のテキストです。ひらがなとカタカナと漢字を含みます。" in
+assert (first_detected s |> f __LINE__ "%s" = "UTF-8");
+List.iter (fun tocode ->
+	let c = iconv_open ~tocode ~fromcode:"UTF-8" in
+	let x = iconv_string c s in
+	assert (first_detected x |> f __LINE__ "%s" = tocode);
+	let c = iconv_open ~tocode:"UTF-8" ~fromcode:(first_detected x) in
+	assert (iconv_string c x = s)
+) ["SHIFT_JIS"; "EUC-JP"; "ISO-2022-JP"; "UTF-16BE"; "UTF-16LE"];
+assert (first_detected ("\xFF\xFE" ^ "A\x00") |> f __LINE__ "%s" = "UTF-16");
+assert (first_detected "\xEF\xBB\xBFA" |> f __LINE__ "%s" = "UTF-8");
+assert (first_detected "ASCII" |> f __LINE__ "%s" = "UTF-8");
+(* an incomplete sequence at the end of the prefix *)
+assert (fst (List.hd (detect_substring s 0 4)) |> f __LINE__ "%s" = "UTF-8");;
+
+(* in_iconv *)
+
+let source_of_string s n = (
+	let pos = ref 0 in
+	fun buf offset len ->
+	let len = min n (min len (String.length s - !pos)) in
+	Bytes.blit_string s !pos buf offset len;
+	pos := !pos + len;
+	len
+);;
+
+let s = "\x41\x1B\x24\x42\x24\x22\x1B\x28\x42\n\n\x42" in
+List.iter (fun n ->
+	let r =
+		In_iconv.open_in ~tocode:"UTF-8" ~fromcode:"ISO-2022-JP"
+			(source_of_string s n)
+	in
+	assert (In_iconv.input_line r |> f __LINE__ "%S" = "Aあ");
+	assert (In_iconv.input_line r |> f __LINE__ "%S" = "");
+	assert (In_iconv.input_line r |> f __LINE__ "%S" = "B");
+	assert (
+		match In_iconv.input_line r with
+		| _ -> false
+		| exception End_of_file -> true
+	)
+) [1; 2; String.length s];
+(* the incomplete sequence is substituted at the end *)
+let r =
+	In_iconv.open_in ~tocode:"UTF-8" ~fromcode:"UTF-16BE"
+		(source_of_string "\x30\x42\x30" 1)
+in
+let b = Bytes.create 4 in
+In_iconv.really_input r b 0 4;
+assert (Bytes.to_string b |> f __LINE__ "%S" = "あ?");
+assert (In_iconv.input r b 0 4 = 0);
+(* a large input over the block *)
+let s = String.concat "" (List.init 100000 (fun _ -> "あいうえお\n")) in
+let r =
+	In_iconv.open_in ~tocode:"EUC-JP" ~fromcode:"UTF-8"
+		(source_of_string s max_int)
+in
+for _i = 1 to 100000 do
+	assert (In_iconv.input_line r = "\xa4\xa2\xa4\xa4\xa4\xa6\xa4\xa8\xa4\xaa")
+done;
+assert (In_iconv.input r b 0 4 = 0);;
+
+(* lines terminated by CR, LF and CRLF *)
+let s = "A\x00\n\x30\x42\x00\r\x00\r\x00\n\x00\n\x00\r\x00B" in
+List.iter (fun n ->
+	let r =
+		In_iconv.open_in ~tocode:"UTF-8" ~fromcode:"UTF-16BE"
+			(source_of_string ("\x00" ^ s) n)
+	in
+	assert (
+		List.of_seq (In_iconv.to_line_seq r)
+		|> fa __LINE__ (fun oc x -> List.iter (Printf.fprintf oc "%S;") x)
+		= ["A"; "あ"; ""; ""; ""; "B"]
+	)
+) [1; 2; 3; 64];
+(* over the block without allocating each line *)
+let lines = List.init 3000 (fun i -> String.make (i mod 200) 'x' ^ "あ") in
+let s = String.concat "\r\n" lines ^ "\r\n" in
+let r =
+	In_iconv.open_in ~tocode:"EUC-JP" ~fromcode:"UTF-8"
+		(source_of_string s max_int)
+in
+let c = iconv_open ~tocode:"EUC-JP" ~fromcode:"UTF-8" in
+let rest = ref lines in
+In_iconv.iter_lines r (fun b pos len ->
+	match !rest with
+	| expected :: tl ->
+		assert (Bytes.sub_string b pos len = iconv_string c expected);
+		rest := tl
+	| [] ->
+		assert false
+);
+assert (!rest = []);;
+
 (* out_iconv *)
 
 let buf = Buffer.create 256 in
@@ -210,6 +568,99 @@ Out_iconv.end_out w;
 let x = Buffer.contents buf |> f __LINE__ "%S" in
 assert (x = "\x41\x1B\x24\x42\x24\x22\x1B\x28\x42\x3F");;
 
+(* the incomplete sequence is carried over to the next output *)
+let s = "Aあい\xffう" ^ String.make 40 'B' ^ "え" in
+let c = iconv_open ~tocode:"UTF-16BE" ~fromcode:"UTF-8" in
+let expected = iconv_string c s in
+for i = 0 to String.length s do
+	for j = i to String.length s do
+		let buf = Buffer.create 256 in
+		let w =
+			Out_iconv.open_out ~tocode:"UTF-16BE" ~fromcode:"UTF-8"
+				(Buffer.add_substring buf)
+		in
+		Out_iconv.output_substring w s 0 i;
+		Out_iconv.output_substring w s i (j - i);
+		Out_iconv.output_substring w s j (String.length s - j);
+		Out_iconv.end_out w;
+		assert (Buffer.contents buf = expected)
+	done
+done;;
+
+(* the previous output is kept in double-buffered mode *)
+let s = String.concat "" (List.init 1000 (fun _ -> "あいうえお")) in
+let buf = Buffer.create 256 in
+let previous = ref None in
+let w =
+	Out_iconv.open_out ~buffer_size:16 ~double_buffered:true ~tocode:"UTF-16BE"
+		~fromcode:"UTF-8" (fun s pos len ->
+			begin match !previous with
+			| Some (p, p_contents) ->
+				assert (String.sub p 0 (String.length p_contents) = p_contents)
+			| None ->
+				()
+			end;
+			let contents = String.sub s pos len in
+			previous := Some (s, contents);
+			Buffer.add_string buf contents
+		)
+in
+Out_iconv.output_string w s;
+Out_iconv.end_out w;
+let c = iconv_open ~tocode:"UTF-16BE" ~fromcode:"UTF-8" in
+assert (Buffer.contents buf = iconv_string c s);;
+
+(* into Buffer.t and out_channel directly *)
+let s = "Aあい\xffう" ^ String.make 40 'B' ^ "え" in
+let c = iconv_open ~tocode:"ISO-2022-JP" ~fromcode:"UTF-8" in
+let expected = iconv_string c s in
+for i = 0 to String.length s do
+	let buf = Buffer.create 256 in
+	let w =
+		Out_iconv.open_out_buffer ~buffer_size:16 ~tocode:"ISO-2022-JP"
+			~fromcode:"UTF-8" buf
+	in
+	Out_iconv.output_substring w s 0 i;
+	Out_iconv.output_substring w s i (String.length s - i);
+	Out_iconv.end_out w;
+	assert (Buffer.contents buf = expected)
+done;
+let name = Filename.temp_file "test_conv" ".txt" in
+let oc = open_out_bin name in
+output_string oc "head";
+let w = Out_iconv.open_out_channel ~tocode:"ISO-2022-JP" ~fromcode:"UTF-8" oc in
+Out_iconv.output_substring w s 0 2;
+Out_iconv.output_substring w s 2 (String.length s - 2);
+Out_iconv.end_out w;
+(* over the buffer of the channel *)
+let large = String.concat "" (List.init 30000 (fun _ -> "あA")) in
+Out_iconv.output_string w large;
+Out_iconv.end_out w;
+close_out oc;
+assert (read_file name = "head" ^ expected ^ iconv_string c large);
+Sys.remove name;;
+
+(* close *)
+let c = iconv_open ~tocode:"UTF-16BE" ~fromcode:"UTF-8" in
+assert (iconv_string c "A" = "\x00A");
+close c;
+assert (
+	match iconv_string c "A" with
+	| exception Invalid_argument _ -> true
+	| _ -> false
+);
+assert (
+	match iconv_reset c with
+	| exception Invalid_argument _ -> true
+	| () -> false
+);
+close c; (* twice *)
+let c' = iconv_open ~tocode:"UTF-16BE" ~fromcode:"UTF-8" in
+assert (
+	Fun.protect ~finally:(fun () -> close c') (fun () -> iconv_string c' "B")
+	= "\x00B"
+);;
+
 (* report *)
 
 prerr_endline "ok";;
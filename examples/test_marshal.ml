@@ -24,4 +24,20 @@ match check_marshal c with
 	exit 1
 | checked ->
 	assert (checked |> f __LINE__ "%B");
+	(* opened at the first use *)
+	set_substitute c "?";
+	let a =
+		marshal
+			(Array.init 100 (fun _ -> iconv_open ~tocode:"sjis" ~fromcode:"euc-jp"))
+	in
+	assert (iconv_string a.(0) "\xa4\xa2" |> f __LINE__ "%S" = "\x82\xa0");
+	let d = marshal c in
+	assert (check_marshal d);
+	assert (iconv_string d "\xa4\xa2\xff" |> f __LINE__ "%S" = "\x82\xa0?");
+	close a.(1);
+	assert (
+		match iconv_string a.(1) "" with
+		| _ -> false
+		| exception Invalid_argument _ -> true
+	);
 	prerr_endline "ok";;
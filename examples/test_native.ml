@@ -0,0 +1,75 @@
+open Iconv;;
+
+(* The conversions between these encodings are done without iconv on glibc,
+   and the conversions from single-byte encodings are done with the tables.
+   They are compared with iconv opened with the suffix "//". *)
+
+let encodings = [
+	"ASCII"; "ISO-8859-1"; "UTF-8"; "UTF-16BE"; "UTF-16LE"; "UTF-32BE";
+	"UTF-32LE"
+];;
+
+let random_string () = (
+	let length = Random.int 64 in
+	String.init length (fun _ ->
+		match Random.int 4 with
+		| 0 -> Char.chr (Random.int 256)
+		| 1 -> '\x00'
+		| _ -> Char.chr (Random.int 128)
+	)
+);;
+
+let compare_fields ~tocode ~fromcode c1 c2 s outbuf_length = (
+	let make () = {
+		inbuf = s;
+		inbuf_offset = 0;
+		inbytesleft = String.length s;
+		outbuf = Bytes.make outbuf_length '\x00';
+		outbuf_offset = 0;
+		outbytesleft = outbuf_length
+	} in
+	let fields1 = make () in
+	let fields2 = make () in
+	let r1 = iconv c1 fields1 true in
+	let r2 = iconv c2 fields2 true in
+	if r1 <> r2 || fields1 <> fields2 then (
+		prerr_endline (tocode ^ " <- " ^ fromcode ^ ": " ^ String.escaped s);
+		assert false
+	)
+);;
+
+Random.init 0;;
+
+let compare ~tocode ~fromcode = (
+	match iconv_open ~tocode:(tocode ^ "//") ~fromcode:(fromcode ^ "//") with
+	| exception Failure _ ->
+		() (* the suffix or the encoding is not supported *)
+	| c2 ->
+		let c1 = iconv_open ~tocode ~fromcode in
+		for _ = 1 to 1000 do
+			let s = random_string () in
+			assert (iconv_string c1 s = iconv_string c2 s);
+			compare_fields ~tocode ~fromcode c1 c2 s (Random.int 16)
+		done
+);;
+
+List.iter (fun tocode ->
+	List.iter (fun fromcode ->
+		compare ~tocode ~fromcode
+	) encodings
+) encodings;;
+
+List.iter (fun (tocode, fromcode) ->
+	compare ~tocode ~fromcode
+) [
+	"UTF-8", "CP1252";
+	"UTF-16LE", "KOI8-R";
+	"ISO-8859-1", "CP1252";
+	"CP1251", "KOI8-R";
+	"SHIFT_JIS", "ISO-8859-1";
+	"ISO-2022-JP", "KOI8-R" (* stateful tocode *)
+];;
+
+(* report *)
+
+prerr_endline "ok";;
@@ -0,0 +1,70 @@
+let f fmt = Lib_test.f __FILE__ fmt;;
+
+open Iconv;;
+
+let repeat (n: int) (s: string) = (
+	let b = Buffer.create (String.length s * n) in
+	for _ = 1 to n do Buffer.add_string b s done;
+	Buffer.contents b
+);;
+
+let of_string s = (
+	let b = Bigarray.Array1.create Bigarray.char Bigarray.c_layout
+		(String.length s)
+	in
+	String.iteri (Bigarray.Array1.set b) s;
+	b
+);;
+
+let to_string b = (
+	String.init (Bigarray.Array1.dim b) (Bigarray.Array1.get b)
+);;
+
+(* 1MB, including invalid bytes *)
+let utf8 = repeat 20000 "A\xe3\x81\x82\xf0\x9f\x98\x80\xc3\xa9 \xffx\n日本語\xe3\x81";;
+
+let compare ~tocode ~fromcode s = (
+	let expected = iconv_string (iconv_open ~tocode ~fromcode) s in
+	List.iter (fun workers ->
+		let c = iconv_open ~tocode ~fromcode in
+		let x = Parallel.convert ~workers c s in
+		if x <> expected then (
+			prerr_endline (tocode ^ " <- " ^ fromcode ^ ": workers "
+				^ string_of_int workers);
+			assert false
+		);
+		assert (to_string (Parallel.convert_bigarray ~workers c (of_string s))
+			= expected);
+		(* the handle can be used again *)
+		assert (iconv_string c s = expected)
+	) [1; 2; 3; 8]
+);;
+
+let encode ~tocode s = iconv_string (iconv_open ~tocode ~fromcode:"UTF-8") s;;
+
+compare ~tocode:"UTF-16LE" ~fromcode:"UTF-8" utf8;;
+compare ~tocode:"SHIFT_JIS" ~fromcode:"UTF-8" utf8;;
+compare ~tocode:"UTF-8" ~fromcode:"UTF-16BE" (encode ~tocode:"UTF-16BE" utf8);;
+compare ~tocode:"UTF-8" ~fromcode:"UTF-32LE" (encode ~tocode:"UTF-32LE" utf8);;
+compare ~tocode:"UTF-8" ~fromcode:"SHIFT_JIS" (encode ~tocode:"SHIFT_JIS" utf8);;
+compare ~tocode:"UTF-8" ~fromcode:"EUC-JP" (encode ~tocode:"EUC-JP" utf8);;
+compare ~tocode:"UTF-8" ~fromcode:"CP1252" (encode ~tocode:"CP1252" utf8);;
+(* stateful or with BOM, converted sequentially *)
+compare ~tocode:"ISO-2022-JP" ~fromcode:"UTF-8" utf8;;
+compare ~tocode:"UTF-16" ~fromcode:"UTF-8" utf8;;
+compare ~tocode:"UTF-8" ~fromcode:"ISO-2022-JP" (encode ~tocode:"ISO-2022-JP" utf8);;
+
+(* short input *)
+let c = iconv_open ~tocode:"UTF-16BE" ~fromcode:"UTF-8" in
+assert (Parallel.convert c "Aあ" |> f __LINE__ "%S" = "\x00A\x30\x42");
+assert (Parallel.convert c "" = "");
+assert (Parallel.convert_substring c "xAあ" 1 1 = "\x00A");
+assert (
+	match Parallel.convert ~workers:0 c "A" with
+	| exception Invalid_argument _ -> true
+	| _ -> false
+);;
+
+(* report *)
+
+prerr_endline "ok";;
@@ -0,0 +1,55 @@
+let f fmt = Lib_test.f __FILE__ fmt;;
+
+open Iconv;;
+
+let pool = Pool.create 2 in
+let c =
+	Pool.checkout ~substitute:"*" pool ~tocode:"ISO-2022-JP" ~fromcode:"UTF-8"
+in
+assert (substitute c |> f __LINE__ "%S" = "*");
+let x = iconv_string c "Aあ" |> f __LINE__ "%S" in
+assert (x = "\x41\x1B\x24\x42\x24\x22\x1B\x28\x42");
+Pool.return pool c;
+assert (
+	match iconv_string c "A" with
+	| exception Invalid_argument _ -> true
+	| _ -> false
+);
+let c' = Pool.checkout pool ~tocode:"ISO-2022-JP" ~fromcode:"UTF-8" in
+assert (substitute c' |> f __LINE__ "%S" = "?");
+let x = iconv_string c' "A" |> f __LINE__ "%S" in
+assert (x = "A");
+Pool.return pool c';
+let c'' =
+	Pool.checkout ~substitute:"*" pool ~tocode:"ISO-2022-JP" ~fromcode:"UTF-8"
+in
+assert (substitute c'' |> f __LINE__ "%S" = "*");
+Pool.return pool c'';
+assert (Pool.hits pool |> f __LINE__ "%d" = 1);
+assert (Pool.misses pool |> f __LINE__ "%d" = 2);
+(* with_converter *)
+let x =
+	Pool.with_converter pool ~tocode:"UTF-16BE" ~fromcode:"UTF-8" (fun c ->
+		iconv_string c "A"
+	)
+in
+assert (x = "\x00A");
+let x =
+	Pool.with_converter pool ~tocode:"UTF-16BE" ~fromcode:"UTF-8" (fun c ->
+		iconv_string c "B"
+	)
+in
+assert (x = "\x00B");
+assert (Pool.hits pool |> f __LINE__ "%d" = 2);
+assert (Pool.misses pool |> f __LINE__ "%d" = 3);
+(* evict *)
+let c1 = Pool.checkout pool ~tocode:"UTF-32BE" ~fromcode:"UTF-8" in
+let c2 = Pool.checkout pool ~tocode:"UTF-32LE" ~fromcode:"UTF-8" in
+Pool.return pool c1;
+Pool.return pool c2;
+let _: iconv_t = Pool.checkout pool ~tocode:"ISO-2022-JP" ~fromcode:"UTF-8" in
+assert (Pool.misses pool |> f __LINE__ "%d" = 6);;
+
+(* report *)
+
+prerr_endline "ok";;
@@ -110,6 +110,45 @@ assert (
 		&& Bytes.sub_string fields.outbuf 0 fields.outbuf_offset |> f __LINE__ "%S"
 			= "\x00\x00\xff\xfd" (* U+fffd replacement character *)
 );
+(* iconv_bigarray *)
+let of_string s = (
+	let b = Bigarray.Array1.create Bigarray.char Bigarray.c_layout
+		(String.length s)
+	in
+	String.iteri (Bigarray.Array1.set b) s;
+	b
+) in
+let to_string b pos len = (
+	String.init len (fun i -> Bigarray.Array1.get b (pos + i))
+) in
+let fields = {
+	bigarray_inbuf = of_string "xA\xed\xa0\x80";
+	bigarray_inbuf_offset = 1;
+	bigarray_inbytesleft = 4;
+	bigarray_outbuf = of_string (String.make 16 '\x00');
+	bigarray_outbuf_offset = 0;
+	bigarray_outbytesleft = 16
+}
+in
+let r = iconv_bigarray c fields true |> fa __LINE__ output_result in
+assert (
+	r = `illegal_sequence (* Citrus, glibc *)
+		&& fields.bigarray_inbuf_offset |> f __LINE__ "%d" = 2
+		&& fields.bigarray_outbytesleft |> f __LINE__ "%d" = 12
+	|| r = `ok (* GNU libiconv *)
+);
+assert (to_string fields.bigarray_outbuf 0 4 |> f __LINE__ "%S" = "\x00\x00\x00A");
+let r = iconv_bigarray_substitute c fields true |> fa __LINE__ output_result in
+assert (r = `ok);
+assert (fields.bigarray_inbytesleft |> f __LINE__ "%d" = 0);
+assert (
+	fields.bigarray_outbytesleft |> f __LINE__ "%d" = 0 (* Citrus, glibc *)
+		&& to_string fields.bigarray_outbuf 4 12 |> f __LINE__ "%S"
+			= "\x00\x00\x00?\x00\x00\x00?\x00\x00\x00?"
+	|| fields.bigarray_outbytesleft = 8 (* GNU libiconv *)
+);
+let r = iconv_bigarray_end c fields |> fa __LINE__ output_result in
+assert (r = `ok);
 
 (* report *)
 
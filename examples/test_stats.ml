@@ -0,0 +1,77 @@
+(* This feature is turned on/off by Makefile variable SUPPORT_STATISTICS. *)
+
+let f fmt = Lib_test.f __FILE__ fmt;;
+
+open Iconv;;
+
+let zero = {
+	Stats.bytes_in = 0;
+	bytes_out = 0;
+	iconv_calls = 0;
+	substitutions = 0;
+	overflows = 0;
+	truncations = 0;
+	probes = 0;
+	blocking_time_ns = 0
+};;
+
+if not (Stats.enabled ()) then (
+	let c = iconv_open ~tocode:"UTF-16BE" ~fromcode:"UTF-8" in
+	let _: string = iconv_string c "A" in
+	assert (Stats.snapshot c = zero);
+	assert (Stats.global_snapshot () = zero);
+	Printf.eprintf "%s: configured as no statistics.\n" Sys.argv.(0);
+	exit 1
+);;
+
+let c = iconv_open ~tocode:"UTF-16BE" ~fromcode:"UTF-8" in
+assert (Stats.snapshot c = zero);
+Stats.global_reset ();
+let x = iconv_string c "ab\xffc" in
+assert (x = "\x00a\x00b\x00?\x00c");
+let stats = Stats.snapshot c in
+assert (stats.bytes_in |> f __LINE__ "%d" = 3);
+assert (stats.bytes_out |> f __LINE__ "%d" = 6);
+assert (stats.substitutions |> f __LINE__ "%d" = 1);
+assert (stats.iconv_calls |> f __LINE__ "%d" >= 2);
+let global = Stats.global_snapshot () in
+assert (global.substitutions |> f __LINE__ "%d" = 1);
+Stats.reset c;
+assert (Stats.snapshot c = zero);;
+
+(* overflows and truncations of Out_iconv *)
+let w =
+	Out_iconv.open_out ~buffer_size:16 ~tocode:"UTF-16BE" ~fromcode:"UTF-8"
+		(fun _ _ _ -> ())
+in
+Out_iconv.output_string w (String.make 100 'A');
+Out_iconv.output_string w "\xe3\x81";
+Out_iconv.output_string w "\x82";
+Out_iconv.end_out w;
+let stats = Stats.snapshot (fst (w :> iconv_t * Out_iconv.out_state)) in
+assert (stats.bytes_in |> f __LINE__ "%d" = 103);
+assert (stats.overflows |> f __LINE__ "%d" >= 12);
+assert (stats.truncations |> f __LINE__ "%d" >= 1);
+assert (stats.substitutions |> f __LINE__ "%d" = 0);;
+
+(* probes are counted only if they are not cached *)
+let c = iconv_open ~tocode:"UTF-32LE" ~fromcode:"UTF-32BE" in
+let _: string = substitute c in
+assert (min_sequence_in_fromcode c |> f __LINE__ "%d" = 4);
+assert ((Stats.snapshot c).probes |> f __LINE__ "%d" = 2);
+let c' = iconv_open ~tocode:"UTF-32LE" ~fromcode:"UTF-32BE" in
+let _: string = substitute c' in
+let _: int = min_sequence_in_fromcode c' in
+let _: string = iconv_string c' "\x00\x00\x00A" in
+assert ((Stats.snapshot c').probes |> f __LINE__ "%d" = 0);;
+
+(* pretty printer *)
+let s = Format.asprintf "%a" Iconv_pp.pp_stats zero in
+assert (
+	String.length s > 0 && s.[0] = '<'
+	&& String.sub s (String.length s - 21) 21 = "blocking_time_ns = 0>"
+);;
+
+(* report *)
+
+prerr_endline "ok";;
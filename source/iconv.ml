@@ -11,6 +11,7 @@ type iconv_t;;
 
 external iconv_open: tocode:string -> fromcode:string -> iconv_t =
 	"mliconv_open";;
+external close: iconv_t -> unit = "mliconv_close";;
 
 external substitute: iconv_t -> string = "mliconv_substitute";;
 external set_substitute: iconv_t -> string -> unit = "mliconv_set_substitute";;
@@ -23,6 +24,11 @@ external set_unexist: iconv_t -> [< `auto | `illegal_sequence] -> unit =
 external min_sequence_in_fromcode: iconv_t -> int =
 	"mliconv_min_sequence_in_fromcode";;
 
+external blocking_section_threshold: unit -> int =
+	"mliconv_blocking_section_threshold";;
+external set_blocking_section_threshold: int -> unit =
+	"mliconv_set_blocking_section_threshold";;
+
 type iconv_fields = {
 	mutable inbuf: string;
 	mutable inbuf_offset: int;
@@ -44,6 +50,17 @@ let valid_out (fields: iconv_fields) = (
 	&& outbytesleft <= Bytes.length outbuf - outbuf_offset
 );;
 
+type substitution_report = {
+	mutable substitutions: int;
+	input_offsets: int array;
+	output_offsets: int array
+};;
+
+let make_substitution_report (n: int) = (
+	{substitutions = 0; input_offsets = Array.make n 0;
+		output_offsets = Array.make n 0}
+);;
+
 external unsafe_iconv: iconv_t -> iconv_fields -> bool ->
 	[> `ok | `overflow | `illegal_sequence] =
 	"mliconv_unsafe_iconv";;
@@ -54,12 +71,14 @@ let iconv (cd: iconv_t) (fields: iconv_fields) (finish: bool) = (
 );;
 
 external unsafe_iconv_substitute: iconv_t -> iconv_fields -> bool ->
-	[> `ok | `overflow] =
+	substitution_report option -> [> `ok | `overflow] =
 	"mliconv_unsafe_iconv_substitute";;
 
-let iconv_substitute (cd: iconv_t) (fields: iconv_fields) (finish: bool) = (
+let iconv_substitute ?(report: substitution_report option) (cd: iconv_t)
+	(fields: iconv_fields) (finish: bool) =
+(
 	if valid_in fields && valid_out fields
-	then unsafe_iconv_substitute cd fields finish
+	then unsafe_iconv_substitute cd fields finish report
 	else invalid_arg "Iconv.iconv_substitute" (* __FUNCTION__ *)
 );;
 
@@ -73,17 +92,227 @@ let iconv_end (cd: iconv_t) (fields: iconv_fields) = (
 
 external iconv_reset: iconv_t -> unit = "mliconv_iconv_reset";;
 
-external unsafe_iconv_substring: iconv_t -> string -> int -> int -> string =
+external unsafe_iconv_substring: iconv_t -> string -> int -> int ->
+	substitution_report option -> string =
 	"mliconv_unsafe_iconv_substring";;
 
-let iconv_substring (cd: iconv_t) (s: string) (pos: int) (len: int) = (
+let iconv_substring ?(report: substitution_report option) (cd: iconv_t)
+	(s: string) (pos: int) (len: int) =
+(
 	if pos >= 0 && len >= 0 && len <= String.length s - pos
-	then unsafe_iconv_substring cd s pos len
+	then unsafe_iconv_substring cd s pos len report
 	else invalid_arg "Iconv.iconv_substring" (* __FUNCTION__ *)
 );;
 
-let iconv_string (cd: iconv_t) (s: string) = (
-	unsafe_iconv_substring cd s 0 (String.length s)
+let iconv_string ?(report: substitution_report option) (cd: iconv_t)
+	(s: string) =
+(
+	unsafe_iconv_substring cd s 0 (String.length s) report
+);;
+
+external iconv_strings: iconv_t -> string array -> string array =
+	"mliconv_iconv_strings";;
+
+external unsafe_validate_substring: iconv_t -> string -> int -> int ->
+	[> `ok | `illegal_sequence | `truncated] * int =
+	"mliconv_unsafe_validate_substring";;
+
+let validate_substring (cd: iconv_t) (s: string) (pos: int) (len: int) = (
+	if pos >= 0 && len >= 0 && len <= String.length s - pos then (
+		match unsafe_validate_substring cd s pos len with
+		| `ok, _ -> `ok
+		| `illegal_sequence, offset -> `illegal_sequence offset
+		| `truncated, offset -> `truncated offset
+	) else invalid_arg "Iconv.validate_substring" (* __FUNCTION__ *)
+);;
+
+let validate (cd: iconv_t) (s: string) = (
+	validate_substring cd s 0 (String.length s)
+);;
+
+external unsafe_converted_length_of_substring: iconv_t -> string -> int ->
+	int -> int =
+	"mliconv_unsafe_converted_length_of_substring";;
+
+let converted_length_of_substring (cd: iconv_t) (s: string) (pos: int)
+	(len: int) =
+(
+	if pos >= 0 && len >= 0 && len <= String.length s - pos
+	then unsafe_converted_length_of_substring cd s pos len
+	else invalid_arg "Iconv.converted_length_of_substring" (* __FUNCTION__ *)
+);;
+
+let converted_length (cd: iconv_t) (s: string) = (
+	unsafe_converted_length_of_substring cd s 0 (String.length s)
+);;
+
+external convert_file: iconv_t -> src:string -> dst:string -> unit =
+	"mliconv_convert_file";;
+
+external unsafe_convert_channel: iconv_t -> in_channel -> out_channel ->
+	unit =
+	"mliconv_convert_channel";;
+
+let convert_channel (cd: iconv_t) (ic: in_channel) (oc: out_channel) = (
+	flush oc;
+	unsafe_convert_channel cd ic oc
+);;
+
+type detection_counts = {
+	non_ascii: int;
+	escapes: int;
+	zeros_even: int;
+	zeros_odd: int;
+	utf16be_plausible: int;
+	utf16le_plausible: int;
+	utf8_valid: int;
+	utf8_invalid: int;
+	sjis_valid: int;
+	sjis_invalid: int;
+	sjis_common: int;
+	sjis_kana: int;
+	eucjp_valid: int;
+	eucjp_invalid: int;
+	eucjp_common: int;
+	eucjp_kana: int
+};;
+
+external unsafe_detect_substring: string -> int -> int -> detection_counts =
+	"mliconv_unsafe_detect_substring";;
+
+let detect_bom (s: string) (pos: int) (len: int) = (
+	let has_prefix prefix = (
+		let n = String.length prefix in
+		n <= len
+		&& (
+			let rec loop i = i >= n || s.[pos + i] = prefix.[i] && loop (i + 1) in
+			loop 0
+		)
+	) in
+	if has_prefix "\xEF\xBB\xBF" then Some "UTF-8" else
+	if has_prefix "\x00\x00\xFE\xFF" || has_prefix "\xFF\xFE\x00\x00"
+	then Some "UTF-32" else
+	if has_prefix "\xFE\xFF" || has_prefix "\xFF\xFE" then Some "UTF-16" else
+	None
+);;
+
+(* The ratio of the valid sequences, powered to penalize invalid ones. *)
+let validity (valid: int) (invalid: int) = (
+	if invalid = 0 then 1. else
+	let r = float_of_int valid /. float_of_int (valid + invalid) in
+	r *. r *. r *. r
+);;
+
+let detect_substring (s: string) (pos: int) (len: int) = (
+	if pos >= 0 && len >= 0 && len <= String.length s - pos then (
+		match detect_bom s pos len with
+		| Some name -> [name, 1.]
+		| None ->
+			let c = unsafe_detect_substring s pos len in
+			let zeros = c.zeros_even + c.zeros_odd in
+			(* NUL is rare in the byte-oriented encodings *)
+			let bytewise = 1. -. float_of_int zeros /. float_of_int (max 1 len) in
+			let utf16 plausible zeros_low = (
+				(* ASCII in UTF-16 has zeros at the side of the high byte *)
+				let units = float_of_int (max 1 (len / 2)) in
+				float_of_int plausible /. (2. *. units)
+				*. (1. -. float_of_int zeros_low /. units)
+			) in
+			let utf8 =
+				if c.non_ascii = 0 then (if c.escapes > 0 then 0.5 else 1.) else
+				validity c.utf8_valid c.utf8_invalid
+			in
+			let dbcs valid invalid common kana = (
+				if c.non_ascii = 0 then 0.5 else
+				let total = float_of_int (max 1 (valid + kana)) in
+				validity (valid + kana) invalid
+				*. (0.5 +. 0.4 *. float_of_int common /. total)
+			) in
+			let iso2022jp =
+				if c.escapes = 0 then 0. else
+				if c.non_ascii = 0 then 1. else 0.1
+			in
+			let candidates = [
+				"UTF-8", utf8 *. bytewise;
+				"ISO-2022-JP", iso2022jp *. bytewise;
+				"SHIFT_JIS",
+					dbcs c.sjis_valid c.sjis_invalid c.sjis_common c.sjis_kana *. bytewise;
+				"EUC-JP",
+					dbcs c.eucjp_valid c.eucjp_invalid c.eucjp_common c.eucjp_kana
+					*. bytewise;
+				"UTF-16BE", utf16 c.utf16be_plausible c.zeros_odd;
+				"UTF-16LE", utf16 c.utf16le_plausible c.zeros_even
+			] in
+			List.filter (fun (_, confidence) -> confidence > 0.) candidates
+			|> List.stable_sort (fun (_, x) (_, y) -> compare y x)
+	) else invalid_arg "Iconv.detect_substring" (* __FUNCTION__ *)
+);;
+
+let detect (s: string) = (
+	detect_substring s 0 (String.length s)
+);;
+
+type bigarray =
+	(char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t;;
+
+type iconv_bigarray_fields = {
+	mutable bigarray_inbuf: bigarray;
+	mutable bigarray_inbuf_offset: int;
+	mutable bigarray_inbytesleft: int;
+	mutable bigarray_outbuf: bigarray;
+	mutable bigarray_outbuf_offset: int;
+	mutable bigarray_outbytesleft: int
+};;
+
+let valid_bigarray_in (fields: iconv_bigarray_fields) = (
+	let {bigarray_inbuf; bigarray_inbuf_offset; bigarray_inbytesleft; _} =
+		fields
+	in
+	bigarray_inbuf_offset >= 0 && bigarray_inbytesleft >= 0
+	&& bigarray_inbytesleft
+		<= Bigarray.Array1.dim bigarray_inbuf - bigarray_inbuf_offset
+);;
+
+let valid_bigarray_out (fields: iconv_bigarray_fields) = (
+	let {bigarray_outbuf; bigarray_outbuf_offset; bigarray_outbytesleft; _} =
+		fields
+	in
+	bigarray_outbuf_offset >= 0 && bigarray_outbytesleft >= 0
+	&& bigarray_outbytesleft
+		<= Bigarray.Array1.dim bigarray_outbuf - bigarray_outbuf_offset
+);;
+
+external unsafe_iconv_bigarray: iconv_t -> iconv_bigarray_fields -> bool ->
+	[> `ok | `overflow | `illegal_sequence] =
+	"mliconv_unsafe_iconv_bigarray";;
+
+let iconv_bigarray (cd: iconv_t) (fields: iconv_bigarray_fields)
+	(finish: bool) =
+(
+	if valid_bigarray_in fields && valid_bigarray_out fields
+	then unsafe_iconv_bigarray cd fields finish
+	else invalid_arg "Iconv.iconv_bigarray" (* __FUNCTION__ *)
+);;
+
+external unsafe_iconv_bigarray_substitute: iconv_t -> iconv_bigarray_fields ->
+	bool -> substitution_report option -> [> `ok | `overflow] =
+	"mliconv_unsafe_iconv_bigarray_substitute";;
+
+let iconv_bigarray_substitute ?(report: substitution_report option)
+	(cd: iconv_t) (fields: iconv_bigarray_fields) (finish: bool) =
+(
+	if valid_bigarray_in fields && valid_bigarray_out fields
+	then unsafe_iconv_bigarray_substitute cd fields finish report
+	else invalid_arg "Iconv.iconv_bigarray_substitute" (* __FUNCTION__ *)
+);;
+
+external unsafe_iconv_bigarray_end: iconv_t -> iconv_bigarray_fields ->
+	[> `ok | `overflow] =
+	"mliconv_unsafe_iconv_bigarray_end";;
+
+let iconv_bigarray_end (cd: iconv_t) (fields: iconv_bigarray_fields) = (
+	if valid_bigarray_out fields then unsafe_iconv_bigarray_end cd fields
+	else invalid_arg "Iconv.iconv_bigarray_end" (* __FUNCTION__ *)
 );;
 
 let decode_inbuf_offset = 0;;
@@ -202,4 +431,136 @@ let iconv_decode: type a b c. iconv_decode -> (a -> b -> char) ->
 		decode_in decode hd_f tl_f is_empty_f cont_f fail a b b
 	) else decode_out decode cont_f a b b;;
 
+external unsafe_decode_substring: iconv_t -> string -> int -> int ->
+	Uchar.t array * int array * [> `ok | `illegal_sequence | `truncated] =
+	"mliconv_unsafe_decode_substring";;
+
+let decode_substring (decode: iconv_decode) (s: string) (pos: int)
+	(len: int) =
+(
+	let loc = "Iconv.decode_substring" (* __FUNCTION__ *) in
+	if pos >= 0 && len >= 0 && len <= String.length s - pos then (
+		let cd, fields = decode in
+		let queued = fields.outbuf_offset - decode_outbuf_offset in
+		if queued = 0 then unsafe_decode_substring cd s pos len
+		else if queued mod 4 = 0 then (
+			(* the rest of the previous iconv_decode precedes *)
+			let n = queued / 4 in
+			let prefix =
+				Array.init n (fun i ->
+					get_uchar fields.outbuf (decode_outbuf_offset + i * 4) loc)
+			in
+			fields.outbuf_offset <- decode_outbuf_offset;
+			fields.outbytesleft <- decode_outbuf_capacity;
+			let chars, offsets, error = unsafe_decode_substring cd s pos len in
+			Array.append prefix chars, Array.append (Array.make n pos) offsets,
+				error
+		) else failwith loc (* output is not UTF-32 *)
+	) else invalid_arg loc
+);;
+
+let encode_inbuf_capacity = 0x1000;; (* 1024 code points in UTF-32 *)
+let encode_outbuf_capacity = 0x4000;;
+
+type iconv_encode_state = {
+	encode_fields: iconv_fields;
+	encode_inbuf: bytes; (* same as encode_fields.inbuf *)
+	encode_sink: string -> int -> int -> unit
+};;
+type iconv_encode = iconv_t * iconv_encode_state;;
+
+let iconv_open_encode ~(tocode: string) (f: string -> int -> int -> unit) = (
+	let cd = iconv_open ~tocode ~fromcode:"UTF-32BE" in
+	let inbuf = Bytes.create encode_inbuf_capacity in
+	cd, {
+		encode_fields = {
+			inbuf = Bytes.unsafe_to_string inbuf;
+			inbuf_offset = 0;
+			inbytesleft = 0;
+			outbuf = Bytes.create encode_outbuf_capacity;
+			outbuf_offset = 0;
+			outbytesleft = encode_outbuf_capacity
+		};
+		encode_inbuf = inbuf;
+		encode_sink = f
+	}
+);;
+
+let encode_out (state: iconv_encode_state) = (
+	let {encode_fields = fields; encode_sink; _} = state in
+	let out_length = fields.outbuf_offset in
+	if out_length > 0 then (
+		encode_sink (Bytes.unsafe_to_string fields.outbuf) 0 out_length;
+		fields.outbuf_offset <- 0;
+		fields.outbytesleft <- encode_outbuf_capacity
+	)
+);;
+
+(* Convert the queued code points at once, and rewind the scratch block. *)
+let rec encode_in (encode: iconv_encode) = (
+	let cd, state = encode in
+	let {encode_fields = fields; _} = state in
+	match unsafe_iconv_substitute cd fields true None with
+	| `ok ->
+		fields.inbuf_offset <- 0
+	| `overflow ->
+		encode_out state;
+		encode_in encode
+);;
+
+let encode_uchar (encode: iconv_encode) (c: Uchar.t) = (
+	let _, {encode_fields = fields; encode_inbuf; _} = encode in
+	let queued = fields.inbytesleft in
+	Bytes.set_int32_be encode_inbuf queued (Int32.of_int (Uchar.to_int c));
+	let queued = queued + 4 in
+	fields.inbytesleft <- queued;
+	if queued = encode_inbuf_capacity then encode_in encode
+);;
+
+let encode_uchars (encode: iconv_encode) (a: Uchar.t array) = (
+	let _, {encode_fields = fields; encode_inbuf; _} = encode in
+	let length = Array.length a in
+	let rec loop i = (
+		if i < length then (
+			let queued = fields.inbytesleft in
+			let n = min (length - i) ((encode_inbuf_capacity - queued) / 4) in
+			for j = 0 to n - 1 do
+				Bytes.set_int32_be encode_inbuf (queued + j * 4)
+					(Int32.of_int (Uchar.to_int a.(i + j)))
+			done;
+			let queued = queued + n * 4 in
+			fields.inbytesleft <- queued;
+			if queued = encode_inbuf_capacity then encode_in encode;
+			loop (i + n)
+		)
+	) in
+	loop 0
+);;
+
+let encode_flush (encode: iconv_encode) = (
+	let _, state = encode in
+	if state.encode_fields.inbytesleft > 0 then encode_in encode;
+	encode_out state
+);;
+
+let encode_end (encode: iconv_encode) = (
+	let cd, state = encode in
+	let {encode_fields = fields; _} = state in
+	if fields.inbytesleft > 0 then encode_in encode;
+	let rec loop () = (
+		match unsafe_iconv_end cd fields with
+		| `ok ->
+			()
+		| `overflow ->
+			encode_out state;
+			loop ()
+	) in
+	loop ();
+	encode_out state
+);;
+
+module In_iconv = Iconv__In_iconv;;
 module Out_iconv = Iconv__Out_iconv;;
+module Parallel = Iconv__Parallel;;
+module Pool = Iconv__Pool;;
+module Stats = Iconv__Stats;;
@@ -5,9 +5,17 @@ external iconv_get_version_opt: unit -> (int * int) option =
 val iconv_get_version_string_opt: unit -> string option
 
 type iconv_t
+(** If the library is built with [SUPPORT_SERIALIZATION], [iconv_t] can be
+    marshalled.  An unmarshalled [iconv_t] calls [iconv_open] at its first
+    use, so [Failure] for an unsupported encoding is raised then. *)
 
 external iconv_open: tocode:string -> fromcode:string -> iconv_t =
 	"mliconv_open"
+external close: iconv_t -> unit = "mliconv_close"
+(** Release the handle without waiting for GC.
+    Converting with it raises [Invalid_argument] after that.
+    Closing twice is allowed.
+    It waits while another thread is converting with it. *)
 
 external substitute: iconv_t -> string = "mliconv_substitute"
 external set_substitute: iconv_t -> string -> unit = "mliconv_set_substitute"
@@ -24,6 +32,19 @@ external set_unexist: iconv_t -> [< `auto | `illegal_sequence] -> unit =
 external min_sequence_in_fromcode: iconv_t -> int =
 	"mliconv_min_sequence_in_fromcode"
 
+external blocking_section_threshold: unit -> int =
+	"mliconv_blocking_section_threshold"
+external set_blocking_section_threshold: int -> unit =
+	"mliconv_set_blocking_section_threshold"
+(** The input of [iconv], [iconv_substitute] and [iconv_substring] is copied
+    outside of OCaml heap and converted without the runtime lock if its length
+    is this value or more, so other threads can run in parallel.
+    It should be positive, and the default is 65536.
+    An [iconv_t] has its shift state, so it should not be shared by threads
+    at once.  Using, closing or returning to a pool an [iconv_t] while another
+    thread is converting with it waits for the conversion without the runtime
+    lock. *)
+
 type iconv_fields = {
 	mutable inbuf: string;
 	mutable inbuf_offset: int;
@@ -33,14 +54,91 @@ type iconv_fields = {
 	mutable outbytesleft: int
 }
 
+type substitution_report = {
+	mutable substitutions: int;
+	input_offsets: int array;
+	output_offsets: int array
+}
+(** [substitutions] is incremented for each substituted sequence, and the
+    offsets of the sequence in the input and of the substitute in the output
+    are stored at the index [substitutions] while it is less than the length
+    of the arrays.  The offsets are the positions in [inbuf] and [outbuf], or
+    the source and the result of [iconv_substring].
+    It is not reset automatically, so it accumulates over calls. *)
+
+val make_substitution_report: int -> substitution_report
+(** Make a report that keeps the offsets of the first [n] substitutions. *)
+
 val iconv: iconv_t -> iconv_fields -> bool ->
 	[> `ok | `overflow | `illegal_sequence]
-val iconv_substitute: iconv_t -> iconv_fields -> bool -> [> `ok | `overflow]
+val iconv_substitute: ?report:substitution_report -> iconv_t -> iconv_fields ->
+	bool -> [> `ok | `overflow]
 val iconv_end: iconv_t -> iconv_fields -> [> `ok | `overflow]
 external iconv_reset: iconv_t -> unit = "mliconv_iconv_reset"
 
-val iconv_substring: iconv_t -> string -> int -> int -> string
-val iconv_string: iconv_t -> string -> string
+val iconv_substring: ?report:substitution_report -> iconv_t -> string -> int ->
+	int -> string
+val iconv_string: ?report:substitution_report -> iconv_t -> string -> string
+
+external iconv_strings: iconv_t -> string array -> string array =
+	"mliconv_iconv_strings"
+(** Same as [Array.map (iconv_string cd)], but all strings are converted in
+    one call.  The shift state is reset at the end of each string. *)
+
+val validate_substring: iconv_t -> string -> int -> int ->
+	[> `ok | `illegal_sequence of int | `truncated of int]
+val validate: iconv_t -> string ->
+	[> `ok | `illegal_sequence of int | `truncated of int]
+(** Check whether the string can be converted without substitution, and
+    return the offset of the first illegal or truncated sequence.
+    Characters that do not exist in [tocode] are also illegal.
+    The output is discarded in a small buffer. *)
+
+val converted_length_of_substring: iconv_t -> string -> int -> int -> int
+val converted_length: iconv_t -> string -> int
+(** Return [String.length (iconv_string cd s)] without making the string. *)
+
+external convert_file: iconv_t -> src:string -> dst:string -> unit =
+	"mliconv_convert_file"
+val convert_channel: iconv_t -> in_channel -> out_channel -> unit
+(** Convert the file or the rest of the channel into another one by blocks of
+    256KiB without the runtime lock, so the memory does not grow with the
+    length of the input.  Sequences split between blocks are carried over,
+    and illegal sequences are substituted same as [iconv_substitute].
+    [Sys_error] is raised if reading or writing fails, with the name of the
+    file failed for [convert_file].  [convert_file] removes the destination
+    if it is a regular file and fails after the destination is opened. *)
+
+val detect_substring: string -> int -> int -> (string * float) list
+val detect: string -> (string * float) list
+(** Guess the encoding among UTF-8, UTF-16, UTF-32 with a BOM, UTF-16BE,
+    UTF-16LE, Shift_JIS, EUC-JP and ISO-2022-JP by scanning the string once
+    without conversion, and return the names for [iconv_open] with the
+    confidences from 0 to 1 in descending order.
+    The BOM is left in the input, so it is converted as U+FEFF for UTF-8.
+    Pass a prefix of the input to reduce the cost. *)
+
+type bigarray =
+	(char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+type iconv_bigarray_fields = {
+	mutable bigarray_inbuf: bigarray;
+	mutable bigarray_inbuf_offset: int;
+	mutable bigarray_inbytesleft: int;
+	mutable bigarray_outbuf: bigarray;
+	mutable bigarray_outbuf_offset: int;
+	mutable bigarray_outbytesleft: int
+}
+
+val iconv_bigarray: iconv_t -> iconv_bigarray_fields -> bool ->
+	[> `ok | `overflow | `illegal_sequence]
+val iconv_bigarray_substitute: ?report:substitution_report -> iconv_t ->
+	iconv_bigarray_fields -> bool -> [> `ok | `overflow]
+val iconv_bigarray_end: iconv_t -> iconv_bigarray_fields -> [> `ok | `overflow]
+(** Same as [iconv], [iconv_substitute] and [iconv_end] with bigarrays.
+    The bigarrays are not copied, and not moved by GC, so the conversion runs
+    without the runtime lock if [bigarray_inbytesleft] is
+    [blocking_section_threshold ()] or more. *)
 
 type iconv_decode_state
 type iconv_decode = private iconv_t * iconv_decode_state
@@ -53,4 +151,32 @@ val iconv_decode: iconv_decode -> ('a -> 'b -> char) -> ('a -> 'b -> 'b) ->
 	('a -> 'b -> bool) -> ('a -> 'b -> 'b -> Uchar.t -> 'c) ->
 	fail:('a -> 'b -> 'b -> [> iconv_decode_error] -> 'c) -> 'a -> 'b -> 'c
 
+val decode_substring: iconv_decode -> string -> int -> int ->
+	Uchar.t array * int array * [> `ok | `illegal_sequence | `truncated]
+(** Decode the substring into code points at once.
+    The second array has the start offset of the sequence of each code point,
+    and the offset where the decoding stopped as the last element.
+    The decoding stops at an illegal or a truncated sequence. *)
+
+type iconv_encode_state
+type iconv_encode = private iconv_t * iconv_encode_state
+
+val iconv_open_encode: tocode:string -> (string -> int -> int -> unit) ->
+	iconv_encode
+(** Make an encoder from code points writing into the sink function.
+    Code points are queued in a UTF-32 block and converted at once when it is
+    full or flushed, and substituted same as [iconv_substitute].
+    The output buffer is reused, so the sink should consume or copy the passed
+    string before it returns. *)
+
+val encode_uchar: iconv_encode -> Uchar.t -> unit
+val encode_uchars: iconv_encode -> Uchar.t array -> unit
+val encode_flush: iconv_encode -> unit
+val encode_end: iconv_encode -> unit
+(** Same as [encode_flush], and also return to the initial shift state. *)
+
+module In_iconv = Iconv__In_iconv
 module Out_iconv = Iconv__Out_iconv
+module Parallel = Iconv__Parallel
+module Pool = Iconv__Pool
+module Stats = Iconv__Stats
@@ -0,0 +1,236 @@
+open Iconv;;
+
+type in_state = {
+	fields: iconv_fields;
+	block: bytes; (* same as fields.inbuf *)
+	source: bytes -> int -> int -> int;
+	mutable read_offset: int;
+	mutable eof: bool;
+	mutable ended: bool;
+	mutable skip_lf: bool; (* the previous line is terminated by CR *)
+	mutable line: bytes; (* the head of the line over blocks *)
+	mutable line_length: int
+};;
+type t = iconv_t * in_state;;
+
+let inbuf_capacity = 0x10000;;
+let outbuf_capacity = 0x10000;;
+
+let open_in ~(tocode: string) ~(fromcode: string)
+	(source: bytes -> int -> int -> int) =
+(
+	let cd = iconv_open ~tocode ~fromcode in
+	let block = Bytes.create inbuf_capacity in
+	cd, {
+		fields = {
+			inbuf = Bytes.unsafe_to_string block;
+			inbuf_offset = 0;
+			inbytesleft = 0;
+			outbuf = Bytes.create outbuf_capacity;
+			outbuf_offset = 0;
+			outbytesleft = outbuf_capacity
+		};
+		block;
+		source;
+		read_offset = 0;
+		eof = false;
+		ended = false;
+		skip_lf = false;
+		line = Bytes.empty;
+		line_length = 0
+	}
+);;
+
+let open_in_channel ~(tocode: string) ~(fromcode: string) (ic: in_channel) = (
+	open_in ~tocode ~fromcode (input ic)
+);;
+
+(* Convert the next block after all of the output buffer is read.
+   Return false at the end of input. *)
+let fill: t -> bool =
+	let loc = "Iconv.In_iconv.fill" (* __FUNCTION__ *) in
+	let read_block state = (
+		let {fields; block; source; _} = state in
+		let {inbuf_offset; inbytesleft; _} = fields in
+		(* Move the incomplete sequence carried over to the head. *)
+		if inbuf_offset > 0 then (
+			Bytes.blit block inbuf_offset block 0 inbytesleft;
+			fields.inbuf_offset <- 0
+		);
+		let space = Bytes.length block - inbytesleft in
+		let n = source block inbytesleft space in
+		if n = 0 then state.eof <- true
+		else if n > 0 && n <= space then fields.inbytesleft <- inbytesleft + n
+		else failwith loc
+	) in
+	let rec loop cd state = (
+		let {fields; _} = state in
+		if not state.eof then read_block state;
+		if state.eof && fields.inbytesleft = 0 then (
+			match iconv_end cd fields with
+			| `ok ->
+				state.ended <- true
+			| `overflow ->
+				()
+		) else (
+			match iconv_substitute cd fields state.eof with
+			| `ok | `overflow ->
+				()
+		);
+		if fields.outbuf_offset > 0 then true
+		else if state.ended then false
+		else loop cd state
+	) in
+	fun (cd, state) ->
+	let {fields; _} = state in
+	fields.outbuf_offset <- 0;
+	fields.outbytesleft <- Bytes.length fields.outbuf;
+	state.read_offset <- 0;
+	if state.ended then false
+	else loop cd state;;
+
+let unsafe_input (ic: t) (buf: bytes) (pos: int) (len: int) = (
+	let _, state = ic in
+	let {fields; _} = state in
+	if len > 0 && (state.read_offset < fields.outbuf_offset || fill ic) then (
+		let {read_offset; _} = state in
+		let n = min len (fields.outbuf_offset - read_offset) in
+		Bytes.blit fields.outbuf read_offset buf pos n;
+		state.read_offset <- read_offset + n;
+		n
+	) else 0
+);;
+
+let input (ic: t) (buf: bytes) (pos: int) (len: int) = (
+	if pos >= 0 && len >= 0 && len <= Bytes.length buf - pos
+	then unsafe_input ic buf pos len
+	else invalid_arg "Iconv.In_iconv.input" (* __FUNCTION__ *)
+);;
+
+let really_input (ic: t) (buf: bytes) (pos: int) (len: int) = (
+	if pos >= 0 && len >= 0 && len <= Bytes.length buf - pos then (
+		let rec loop pos len = (
+			if len > 0 then (
+				let n = unsafe_input ic buf pos len in
+				if n = 0 then raise End_of_file
+				else loop (pos + n) (len - n)
+			)
+		) in
+		loop pos len
+	) else invalid_arg "Iconv.In_iconv.really_input" (* __FUNCTION__ *)
+);;
+
+let input_line: t -> string =
+	let rec index_lf s i e = (
+		if i >= e || Bytes.unsafe_get s i = '\n' then i
+		else index_lf s (i + 1) e
+	) in
+	let rec loop ic line = (
+		let _, state = ic in
+		let {fields; _} = state in
+		if state.read_offset < fields.outbuf_offset || fill ic then (
+			let {outbuf; outbuf_offset; _} = fields in
+			let {read_offset; _} = state in
+			let i = index_lf outbuf read_offset outbuf_offset in
+			if i < outbuf_offset then (
+				state.read_offset <- i + 1;
+				match line with
+				| None ->
+					Bytes.sub_string outbuf read_offset (i - read_offset)
+				| Some line ->
+					Buffer.add_subbytes line outbuf read_offset (i - read_offset);
+					Buffer.contents line
+			) else (
+				(* The line continues to the next block. *)
+				state.read_offset <- outbuf_offset;
+				let line =
+					match line with
+					| None -> Buffer.create (2 * (outbuf_offset - read_offset))
+					| Some line -> line
+				in
+				Buffer.add_subbytes line outbuf read_offset
+					(outbuf_offset - read_offset);
+				loop ic (Some line)
+			)
+		) else (
+			match line with
+			| None -> raise End_of_file
+			| Some line -> Buffer.contents line
+		)
+	) in
+	fun ic -> loop ic None;;
+
+external unsafe_index_line_end: bytes -> int -> int -> int =
+	"mliconv_unsafe_index_line_end";;
+
+let append_line (state: in_state) (s: bytes) (pos: int) (len: int) = (
+	let {line; line_length; _} = state in
+	if line_length + len > Bytes.length line then (
+		let new_line =
+			Bytes.create (max (2 * Bytes.length line) (line_length + len))
+		in
+		Bytes.blit line 0 new_line 0 line_length;
+		state.line <- new_line
+	);
+	Bytes.blit s pos state.line line_length len;
+	state.line_length <- line_length + len
+);;
+
+(* Call f with the next line in the output buffer, or in the line buffer if it
+   is over blocks, and return false at the end of input. *)
+let next_line: t -> (bytes -> int -> int -> unit) -> bool =
+	let rec loop ic f = (
+		let _, state = ic in
+		let {fields; _} = state in
+		if state.read_offset < fields.outbuf_offset || fill ic then (
+			let {outbuf; outbuf_offset; _} = fields in
+			let {read_offset; _} = state in
+			if state.skip_lf then (
+				state.skip_lf <- false;
+				if Bytes.unsafe_get outbuf read_offset = '\n'
+				then state.read_offset <- read_offset + 1;
+				loop ic f
+			) else (
+				let i = unsafe_index_line_end outbuf read_offset outbuf_offset in
+				if i < outbuf_offset then (
+					state.read_offset <- i + 1;
+					state.skip_lf <- Bytes.unsafe_get outbuf i = '\r';
+					let {line_length; _} = state in
+					if line_length = 0 then f outbuf read_offset (i - read_offset)
+					else (
+						append_line state outbuf read_offset (i - read_offset);
+						state.line_length <- 0;
+						f state.line 0 (line_length + i - read_offset)
+					);
+					true
+				) else (
+					(* The line continues to the next block. *)
+					append_line state outbuf read_offset (outbuf_offset - read_offset);
+					state.read_offset <- outbuf_offset;
+					loop ic f
+				)
+			)
+		) else (
+			let {line_length; _} = state in
+			if line_length > 0 then (
+				state.line_length <- 0;
+				f state.line 0 line_length;
+				true
+			) else false
+		)
+	) in
+	loop;;
+
+let iter_lines (ic: t) (f: bytes -> int -> int -> unit) = (
+	while next_line ic f do () done
+);;
+
+let to_line_seq (ic: t) = (
+	let rec next () = (
+		let line = ref "" in
+		if next_line ic (fun s pos len -> line := Bytes.sub_string s pos len)
+		then Seq.Cons (!line, next)
+		else Seq.Nil
+	) in
+	next
+);;
@@ -0,0 +1,32 @@
+open Iconv
+
+type in_state
+type t = private iconv_t * in_state
+
+val open_in: tocode:string -> fromcode:string ->
+	(bytes -> int -> int -> int) -> t
+(** Make a decoder reading from the source function like [Stdlib.input] or
+    [Unix.read].
+    The source is read and converted by large blocks, and an incomplete
+    sequence at the end of a block is carried over to the next block.
+    The source should return 0 at the end of input. *)
+
+val open_in_channel: tocode:string -> fromcode:string -> in_channel -> t
+
+val input: t -> bytes -> int -> int -> int
+val really_input: t -> bytes -> int -> int -> unit
+
+val input_line: t -> string
+(** Read until ['\n'].
+    [tocode] should be compatible with ASCII. *)
+
+val iter_lines: t -> (bytes -> int -> int -> unit) -> unit
+(** Call the function with each line terminated by CR, LF or CRLF, without
+    the terminator.  The line is passed as the range of the reused buffer
+    without copying, so it should be consumed or copied before the function
+    returns.  The last line is passed if it is not empty.
+    [tocode] should be compatible with ASCII. *)
+
+val to_line_seq: t -> string Seq.t
+(** Same as [iter_lines], but each line is copied into a string.
+    The sequence reads from the decoder, so it can be iterated only once. *)
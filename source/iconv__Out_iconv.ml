@@ -1,64 +1,146 @@
 open Iconv;;
 
-type out_state = iconv_fields * (string -> int -> int -> unit);;
+type destination =
+	| Sink of (string -> int -> int -> unit)
+	| Buffer of Buffer.t
+	| Channel of out_channel;;
+
+type out_state = {
+	fields: iconv_fields;
+	destination: destination;
+	mutable spare: bytes; (* same as fields.outbuf if not double-buffered *)
+	carry: bytes (* the incomplete sequence and the following bytes *)
+};;
 type t = iconv_t * out_state;;
 
-let outbuf_capacity = 240;;
+let default_buffer_size = 0x10000;;
+let min_buffer_size = 16;; (* greater than MAX_SEQUENCE *)
+let carry_capacity = 32;; (* greater than MAX_SEQUENCE * 2 *)
 
-let open_out ~(tocode: string) ~(fromcode: string)
-	(f: string -> int -> int -> unit) =
+let make_state (buffer_size: int) (double_buffered: bool)
+	(destination: destination) =
 (
-	let cd = iconv_open ~tocode ~fromcode in
-	cd, (
-		{
+	let outbuf = Bytes.create buffer_size in
+	{
+		fields = {
 			inbuf = "";
 			inbuf_offset = 0;
 			inbytesleft = 0;
-			outbuf = Bytes.create outbuf_capacity;
+			outbuf;
 			outbuf_offset = 0;
-			outbytesleft = outbuf_capacity;
-		}, f
-	)
+			outbytesleft = buffer_size;
+		};
+		destination;
+		spare = if double_buffered then Bytes.create buffer_size else outbuf;
+		carry = Bytes.create carry_capacity
+	}
+);;
+
+let make_out (loc: string) (buffer_size: int) (double_buffered: bool)
+	~(tocode: string) ~(fromcode: string) (destination: destination) =
+(
+	if buffer_size < min_buffer_size then invalid_arg loc;
+	let cd = iconv_open ~tocode ~fromcode in
+	cd, make_state buffer_size double_buffered destination
+);;
+
+let open_out ?(buffer_size: int = default_buffer_size)
+	?(double_buffered: bool = false) ~(tocode: string) ~(fromcode: string)
+	(f: string -> int -> int -> unit) =
+(
+	make_out "Iconv.Out_iconv.open_out" (* __FUNCTION__ *) buffer_size
+		double_buffered ~tocode ~fromcode (Sink f)
+);;
+
+let open_out_buffer ?(buffer_size: int = default_buffer_size)
+	~(tocode: string) ~(fromcode: string) (b: Buffer.t) =
+(
+	make_out "Iconv.Out_iconv.open_out_buffer" (* __FUNCTION__ *) buffer_size
+		false ~tocode ~fromcode (Buffer b)
 );;
 
-let do_flush (fields, f: out_state) = (
-		let out_length = fields.outbuf_offset in
-		if out_length > 0 then (
-			f (Bytes.unsafe_to_string fields.outbuf) 0 out_length;
-			let outbuf_length = Bytes.length fields.outbuf in
-			fields.outbuf_offset <- 0;
-			fields.outbuf <- Bytes.create outbuf_length;
-			fields.outbytesleft <- outbuf_length
-		)
+(* The output is written into the buffer of the channel, so outbuf is
+   empty. *)
+let open_out_channel ~(tocode: string) ~(fromcode: string) (oc: out_channel) =
+(
+	let cd = iconv_open ~tocode ~fromcode in
+	cd, make_state 0 false (Channel oc)
+);;
+
+external unsafe_iconv_channel: iconv_t -> iconv_fields -> out_channel ->
+	bool -> unit =
+	"mliconv_unsafe_iconv_channel";;
+
+let do_flush (state: out_state) = (
+	let {fields; destination; _} = state in
+	let out_length = fields.outbuf_offset in
+	if out_length > 0 then (
+		let {outbuf; _} = fields in
+		begin match destination with
+		| Sink sink ->
+			sink (Bytes.unsafe_to_string outbuf) 0 out_length
+		| Buffer b ->
+			Buffer.add_subbytes b outbuf 0 out_length
+		| Channel _ ->
+			assert false (* outbuf is not used *)
+		end;
+		(* Reuse the buffers alternately. *)
+		fields.outbuf <- state.spare;
+		state.spare <- outbuf;
+		fields.outbuf_offset <- 0;
+		fields.outbytesleft <- Bytes.length fields.outbuf
+	)
 );;
 
 let unsafe_output_substring: t -> string -> int -> int -> unit =
+	let loc = "Iconv.output_substring" (* __FUNCTION__ *) in
 	let rec loop oi = (
 		let cd, state = oi in
-		let fields, _ = state in
-		match iconv_substitute cd fields false with
-		| `ok ->
-			()
-		| `overflow ->
-			do_flush state;
-			loop oi
+		let {fields; destination; _} = state in
+		match destination with
+		| Channel oc ->
+			unsafe_iconv_channel cd fields oc false
+		| Sink _ | Buffer _ ->
+			match iconv_substitute cd fields false with
+			| `ok ->
+				()
+			| `overflow ->
+				do_flush state;
+				loop oi
+	) in
+	(* Convert the rest of the previous input with the head of s in the small
+	   buffer, and return the offset of s to be continued. *)
+	let rec carry_over oi s offset len = (
+		let _, {fields; carry; _} = oi in
+		let {inbuf; inbuf_offset; inbytesleft; _} = fields in
+		if inbytesleft >= carry_capacity then failwith loc;
+		Bytes.blit_string inbuf inbuf_offset carry 0 inbytesleft;
+		let appended = min len (carry_capacity - inbytesleft) in
+		Bytes.blit_string s offset carry inbytesleft appended;
+		fields.inbuf <- Bytes.unsafe_to_string carry;
+		fields.inbuf_offset <- 0;
+		fields.inbytesleft <- inbytesleft + appended;
+		loop oi;
+		let rest = fields.inbytesleft in
+		if rest <= appended then offset + appended - rest
+		else if appended < len then (
+			carry_over oi s (offset + appended) (len - appended)
+		) else offset + len (* all of s is carried *)
 	) in
 	fun oi s offset len ->
-	let _, (fields, _) = oi in
-	if fields.inbytesleft = 0 then (
+	let _, {fields; _} = oi in
+	let end_offset = offset + len in
+	let offset =
+		if fields.inbytesleft = 0 || len = 0 then offset
+		else carry_over oi s offset len
+	in
+	if offset < end_offset then (
+		(* Convert s in place. *)
 		fields.inbuf <- s;
 		fields.inbuf_offset <- offset;
-		fields.inbytesleft <- len
-	) else (
-		let inbuf_length = fields.inbytesleft + len in
-		let inbuf = Bytes.create inbuf_length in
-		Bytes.blit_string fields.inbuf fields.inbuf_offset inbuf 0 fields.inbytesleft;
-		Bytes.blit_string s offset inbuf fields.inbytesleft len;
-		fields.inbuf <- Bytes.unsafe_to_string inbuf;
-		fields.inbuf_offset <- 0;
-		fields.inbytesleft <- inbuf_length
-	);
-	loop oi;;
+		fields.inbytesleft <- end_offset - offset;
+		loop oi
+	);;
 
 let output_substring (oi: t) (s: string) (offset: int) (len: int) = (
 	if offset >= 0 && len >= 0 && len <= String.length s - offset
@@ -71,12 +153,14 @@ let output_string (oi: t) (s: string) = (
 );;
 
 let flush (_, state: t) = (
-	do_flush state
+	match state.destination with
+	| Channel oc -> Stdlib.flush oc
+	| Sink _ | Buffer _ -> do_flush state
 );;
 
-let end_out (cd, state: t) = (
+let end_out_buffered (cd: iconv_t) (state: out_state) = (
 	let loc = "Iconv.end_out" (* __FUNCTION__ *) in
-	let fields, f = state in
+	let {fields; _} = state in
 	if fields.inbytesleft > 0 then (
 		match iconv_substitute cd fields true with
 		| `ok ->
@@ -101,23 +185,21 @@ let end_out (cd, state: t) = (
 		| `overflow ->
 			failwith loc
 	end;
-	(* No need to reset the output buffer for reuse. *)
-	let out_length = fields.outbuf_offset in
-	if out_length > 0 then (
-		f (Bytes.unsafe_to_string fields.outbuf) 0 out_length;
-		fields.outbuf <- Bytes.empty;
-		fields.outbytesleft <- 0
-	)
+	do_flush state
+);;
+
+let end_out (cd, state: t) = (
+	match state.destination with
+	| Channel oc ->
+		unsafe_iconv_channel cd state.fields oc true
+	| Sink _ | Buffer _ ->
+		end_out_buffered cd state
 );;
 
 let reset_out (cd, state: t) = (
 	iconv_reset cd;
-	let fields, _ = state in
+	let {fields; _} = state in
 	fields.inbytesleft <- 0;
-	(* Restore from the ended state. *)
 	fields.outbuf_offset <- 0;
-	if Bytes.length fields.outbuf <> outbuf_capacity then (
-		fields.outbuf <- Bytes.create outbuf_capacity
-	);
-	fields.outbytesleft <- outbuf_capacity
+	fields.outbytesleft <- Bytes.length fields.outbuf
 );;
@@ -3,8 +3,24 @@ open Iconv
 type out_state
 type t = private iconv_t * out_state
 
-val open_out: tocode:string -> fromcode:string ->
-	(string -> int -> int -> unit) -> t
+val open_out: ?buffer_size:int -> ?double_buffered:bool -> tocode:string ->
+	fromcode:string -> (string -> int -> int -> unit) -> t
+(** Make an encoder writing into the sink function.
+    The output buffer of [buffer_size] bytes (64KB by default) is reused, so
+    the sink should consume or copy the passed string before it returns.
+    If [double_buffered], two buffers are used alternately and the passed
+    string is kept until the sink is called again. *)
+
+val open_out_buffer: ?buffer_size:int -> tocode:string -> fromcode:string ->
+	Buffer.t -> t
+(** Same as [open_out] with [Buffer.add_substring], but the output buffer is
+    appended to the [Buffer.t] without calling a closure. *)
+
+val open_out_channel: tocode:string -> fromcode:string -> out_channel -> t
+(** Make an encoder converting directly into the buffer of the channel without
+    the intermediate output buffer.  The channel is flushed when its buffer
+    is full, and [flush] also flushes the channel. *)
+
 val output_substring: t -> string -> int -> int -> unit
 val output_string: t -> string -> unit
 val flush: t -> unit
@@ -0,0 +1,30 @@
+open Iconv;;
+
+external recommended_workers: unit -> int =
+	"mliconv_parallel_recommended_workers";;
+
+external unsafe_convert_substring: iconv_t -> string -> int -> int -> int ->
+	string =
+	"mliconv_parallel_unsafe_convert_substring";;
+
+let convert_substring ?(workers: int = recommended_workers ()) (cd: iconv_t)
+	(s: string) (pos: int) (len: int) =
+(
+	if workers > 0 && pos >= 0 && len >= 0 && len <= String.length s - pos
+	then unsafe_convert_substring cd s pos len workers
+	else invalid_arg "Iconv.Parallel.convert_substring" (* __FUNCTION__ *)
+);;
+
+let convert ?(workers: int option) (cd: iconv_t) (s: string) = (
+	convert_substring ?workers cd s 0 (String.length s)
+);;
+
+external unsafe_convert_bigarray: iconv_t -> bigarray -> int -> bigarray =
+	"mliconv_parallel_unsafe_convert_bigarray";;
+
+let convert_bigarray ?(workers: int = recommended_workers ()) (cd: iconv_t)
+	(b: bigarray) =
+(
+	if workers > 0 then unsafe_convert_bigarray cd b workers
+	else invalid_arg "Iconv.Parallel.convert_bigarray" (* __FUNCTION__ *)
+);;
@@ -0,0 +1,20 @@
+open Iconv
+
+external recommended_workers: unit -> int =
+	"mliconv_parallel_recommended_workers"
+(** The number of online processors. *)
+
+val convert_substring: ?workers:int -> iconv_t -> string -> int -> int ->
+	string
+val convert: ?workers:int -> iconv_t -> string -> string
+val convert_bigarray: ?workers:int -> iconv_t -> bigarray -> bigarray
+(** Same as [iconv_string], but a long input is split at boundaries of
+    characters and the chunks are converted by [workers] threads without the
+    runtime lock.
+    The splitting is supported if [fromcode] is UTF-8, UTF-16BE/LE,
+    UTF-32BE/LE, a single-byte encoding, or a multi-byte encoding like
+    Shift_JIS, EUC-JP, GBK and Big5 that can be resynchronized at the bytes
+    that are never trail bytes.  It is also required that [tocode] is stateless
+    and without BOM.  Otherwise the input is converted by one thread.
+    The first chunk is converted with [cd], and the others with new handles
+    opened by the same names.  Each chunk should be 64KB or more. *)
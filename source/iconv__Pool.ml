@@ -0,0 +1,29 @@
+open Iconv;;
+
+type t;;
+
+external create: int -> t = "mliconv_pool_create";;
+
+external unsafe_checkout: t -> tocode:string -> fromcode:string ->
+	string option -> [< `auto | `illegal_sequence] option -> iconv_t =
+	"mliconv_pool_checkout";;
+
+let checkout ?(substitute: string option)
+	?(unexist: [< `auto | `illegal_sequence] option) (pool: t) ~(tocode: string)
+	~(fromcode: string) =
+(
+	unsafe_checkout pool ~tocode ~fromcode substitute unexist
+);;
+
+external return: t -> iconv_t -> unit = "mliconv_pool_return";;
+
+let with_converter ?(substitute: string option)
+	?(unexist: [< `auto | `illegal_sequence] option) (pool: t) ~(tocode: string)
+	~(fromcode: string) (f: iconv_t -> 'a) =
+(
+	let cd = unsafe_checkout pool ~tocode ~fromcode substitute unexist in
+	Fun.protect ~finally:(fun () -> return pool cd) (fun () -> f cd)
+);;
+
+external hits: t -> int = "mliconv_pool_hits";;
+external misses: t -> int = "mliconv_pool_misses";;
@@ -0,0 +1,26 @@
+open Iconv
+
+type t
+
+external create: int -> t = "mliconv_pool_create"
+(** Make a pool that keeps the specified number of converters at most.
+    It can be shared by threads and domains. *)
+
+val checkout: ?substitute:string -> ?unexist:[< `auto | `illegal_sequence] ->
+	t -> tocode:string -> fromcode:string -> iconv_t
+(** Take a converter that is returned before, or open new one.
+    Its substitute and unexist are same as [iconv_open] if they are omitted.
+    Only a converter returned with the same substitute and unexist is taken,
+    so they are not set again. *)
+
+external return: t -> iconv_t -> unit = "mliconv_pool_return"
+(** Put the converter into the pool after resetting its shift state.
+    It can not be used after that.
+    The least recently returned one is closed if the pool is full. *)
+
+val with_converter: ?substitute:string ->
+	?unexist:[< `auto | `illegal_sequence] -> t -> tocode:string ->
+	fromcode:string -> (iconv_t -> 'a) -> 'a
+
+external hits: t -> int = "mliconv_pool_hits"
+external misses: t -> int = "mliconv_pool_misses"
@@ -0,0 +1,20 @@
+open Iconv;;
+
+type t = {
+	bytes_in: int;
+	bytes_out: int;
+	iconv_calls: int;
+	substitutions: int;
+	overflows: int;
+	truncations: int;
+	probes: int;
+	blocking_time_ns: int
+};;
+
+external enabled: unit -> bool = "mliconv_stats_enabled";;
+
+external snapshot: iconv_t -> t = "mliconv_stats_snapshot";;
+external reset: iconv_t -> unit = "mliconv_stats_reset";;
+
+external global_snapshot: unit -> t = "mliconv_stats_global_snapshot";;
+external global_reset: unit -> unit = "mliconv_stats_global_reset";;
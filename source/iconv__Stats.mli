@@ -0,0 +1,26 @@
+(* This feature is turned on/off by Makefile variable SUPPORT_STATISTICS. *)
+
+open Iconv
+
+type t = {
+	bytes_in: int;
+	bytes_out: int;
+	iconv_calls: int;
+	substitutions: int;
+	overflows: int;
+	truncations: int; (** incomplete sequences at the end of the input *)
+	probes: int; (** probes of the substitute and the sequence length not cached *)
+	blocking_time_ns: int (** time converting without the runtime lock *)
+}
+
+external enabled: unit -> bool = "mliconv_stats_enabled"
+(** Return [false] if the counters are compiled out, and they are always 0. *)
+
+external snapshot: iconv_t -> t = "mliconv_stats_snapshot"
+external reset: iconv_t -> unit = "mliconv_stats_reset"
+(** The counters of the converter since it is opened or reset.
+    A converter taken from a pool starts from 0. *)
+
+external global_snapshot: unit -> t = "mliconv_stats_global_snapshot"
+external global_reset: unit -> unit = "mliconv_stats_global_reset"
+(** The counters of all converters in the process. *)
@@ -20,3 +20,23 @@ let pp_iconv (f: Format.formatter) (conv: iconv_t) = (
 		(String.escaped (tocode conv)) (String.escaped (fromcode conv))
 		(String.escaped (substitute conv)) (string_of_unexist (unexist conv))
 );;
+
+let pp_stats (f: Format.formatter) (stats: Stats.t) = (
+	let {
+		Stats.bytes_in; bytes_out; iconv_calls; substitutions; overflows;
+		truncations; probes; blocking_time_ns
+	} = stats in
+	Format.fprintf f
+		"<@[\
+			bytes_in = %d;@ \
+			bytes_out = %d;@ \
+			iconv_calls = %d;@ \
+			substitutions = %d;@ \
+			overflows = %d;@ \
+			truncations = %d;@ \
+			probes = %d;@ \
+			blocking_time_ns = %d\
+		@]>"
+		bytes_in bytes_out iconv_calls substitutions overflows truncations probes
+		blocking_time_ns
+);;
@@ -1,3 +1,5 @@
 open Longident;;
 Topdirs.dir_install_printer Format.std_formatter
 	(Ldot (Lident "Iconv_pp", "pp_iconv"));;
+Topdirs.dir_install_printer Format.std_formatter
+	(Ldot (Lident "Iconv_pp", "pp_stats"));;
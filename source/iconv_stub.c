@@ -1,3 +1,5 @@
+#define CAML_INTERNALS /* struct channel */
+
 #include <caml/misc.h>
 #include <caml/mlvalues.h>
 #include <caml/callback.h>
@@ -7,12 +9,26 @@
 #include <caml/custom.h>
 #include <caml/intext.h>
 #include <caml/signals.h>
+#include <caml/bigarray.h>
+#include <caml/io.h>
+#include <caml/version.h>
 
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <iconv.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /* Tag_some/Val_none are added since OCaml 4.12 */
 
@@ -29,13 +45,24 @@
 /* For example: ISO-8859-1 "\xA2" ("¢") is converted to
    ISO-2022-JP "\x1B\x24\x42\x21\x71\x1B\x28\x42". */
 
+/* The memory outside of OCaml heap for a handle, to tell it to GC.
+   glibc allocates a buffer of 8160 UCS-4 characters for each intermediate
+   step. */
+
+#if !defined(_LIBICONV_VERSION) && defined(__GLIBC__)
+#define HANDLE_SIZE 0x8000
+#else
+#define HANDLE_SIZE 0x400
+#endif
+
 /* polymorphic variants */
 
 enum {
 	Val_auto = -0x7f124121, /* 0x80edbedf */
 	Val_illegal_sequence = -0x699b4d2b, /* 0x9664b2d5 */
 	Val_ok = 0x0000c239,
-	Val_overflow = -0x7d88397b /* 0x8277c685 */
+	Val_overflow = -0x7d88397b, /* 0x8277c685 */
+	Val_truncated = -0x68e64983 /* 0x9719b67d */
 };
 
 /* fields */
@@ -74,8 +101,87 @@ static void get_fields(
 	Store_field(val_fields, field_offset + 2, Val_long(field->bytesleft));
 }
 
+static char *get_bigarray_data(value val_fields, int field_offset)
+{
+	return (char *)Caml_ba_data_val(Field(val_fields, field_offset));
+}
+
+static void set_bigarray_fields(
+	struct iconv_field_s *field, value val_fields, int field_offset)
+{
+	ptrdiff_t buf_offset = Long_val(Field(val_fields, field_offset + 1));
+	field->buf = get_bigarray_data(val_fields, field_offset) + buf_offset;
+	field->bytesleft = Long_val(Field(val_fields, field_offset + 2));
+}
+
+static void get_bigarray_fields(
+	value val_fields, int field_offset, char const *data,
+	struct iconv_field_s const *field)
+{
+	Store_field(val_fields, field_offset + 1, Val_long(field->buf - data));
+	Store_field(val_fields, field_offset + 2, Val_long(field->bytesleft));
+}
+
+/* statistics */
+
+/* The order is same as the fields of Iconv.Stats.t. */
+enum {
+	STAT_BYTES_IN,
+	STAT_BYTES_OUT,
+	STAT_ICONV_CALLS,
+	STAT_SUBSTITUTIONS,
+	STAT_OVERFLOWS,
+	STAT_TRUNCATIONS,
+	STAT_PROBES,
+	STAT_BLOCKING_NS,
+	STAT_COUNT
+};
+
+#if defined(SUPPORT_STATISTICS)
+
+struct stats_s {
+	uint64_t counters[STAT_COUNT];
+};
+
+/* It is updated atomically because handles are used by multiple threads. */
+static struct stats_s global_stats;
+
+static void add_stats(struct stats_s *dst, struct stats_s const *src)
+{
+	for(int i = 0; i < STAT_COUNT; ++ i){
+		dst->counters[i] += src->counters[i];
+	}
+}
+
+static void add_global_stats(struct stats_s const *src)
+{
+	for(int i = 0; i < STAT_COUNT; ++ i){
+		if(src->counters[i] != 0){
+			__atomic_fetch_add(
+				&global_stats.counters[i], src->counters[i], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static uint64_t get_time_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000U + t.tv_nsec;
+}
+
+#define COUNT_STAT(stats, index, n) ((stats)->counters[index] += (n))
+
+#else
+
+#define COUNT_STAT(stats, index, n) ((void)0)
+
+#endif
+
 /* custom data */
 
+struct table_s;
+
 struct mliconv_t {
 	iconv_t handle;
 	char *tocode;
@@ -83,20 +189,156 @@ struct mliconv_t {
 	char substitute[MAX_SEQUENCE];
 	int_least8_t substitute_length;
 	int_least8_t min_sequence_in_fromcode;
+	int_least8_t native;
+	bool substitute_is_set; /* false if the default of tocode */
+	bool unexist; /* ICONV_SET_ILSEQ_INVALID of Citrus */
+	struct table_s *table;
+#if defined(SUPPORT_STATISTICS)
+	struct stats_s stats;
+#endif
 };
 
-#define WSIZE_32_MLICONV (4 * 6)
-#define WSIZE_64_MLICONV (8 * 5)
+#if defined(SUPPORT_STATISTICS)
+#define WSIZE_32_MLICONV (4 * 8 + 8 * STAT_COUNT)
+#define WSIZE_64_MLICONV (8 * 6 + 8 * STAT_COUNT)
+#else
+#define WSIZE_32_MLICONV (4 * 8)
+#define WSIZE_64_MLICONV (8 * 6)
+#endif
+
+#if !defined(_LIBICONV_VERSION) && defined(__FreeBSD__) && __FreeBSD__ >= 10
+#define UNEXIST_AFTER_OPEN false
+#else
+#define UNEXIST_AFTER_OPEN true
+#endif
+
+/* The handle of a deserialized iconv_t is opened at the first use. */
+#define DEFERRED_HANDLE ((iconv_t)-1)
 
 static inline struct mliconv_t *mliconv_val(value v)
 {
 	return (struct mliconv_t *)(Data_custom_val(v));
 }
 
-static void get_substitute(
-	char const *tocode, char *substitute, int_least8_t *substitute_length);
+static inline bool has_handle(struct mliconv_t const *internal)
+{
+	return internal->handle != NULL && internal->handle != DEFERRED_HANDLE;
+}
+
+#if defined(SUPPORT_SERIALIZATION)
+static void open_deferred_handle(value const *val_conv);
+#endif
+
+/* The handle is taken away when it is closed or returned to a pool.
+   val_conv should be registered as a local root. */
+static void check_handle(value const *val_conv)
+{
+	if(mliconv_val(*val_conv)->handle == NULL){
+		caml_invalid_argument("Iconv: iconv_t is closed");
+	}
+#if defined(SUPPORT_SERIALIZATION)
+	if(mliconv_val(*val_conv)->handle == DEFERRED_HANDLE){
+		open_deferred_handle(val_conv);
+	}
+#endif
+}
+
+/* owners of handles */
+
+/* A handle is used by one thread at once, even while the runtime lock is
+   released.  The owners are listed by the handles instead of mliconv_t, that
+   may be moved by GC, so other threads can wait for them without the runtime
+   lock.  A handle is never owned across a point that may raise. */
+
+struct handle_owner_s {
+	iconv_t handle;
+	struct handle_owner_s *next;
+};
+
+static struct handle_owner_s *handle_owners = NULL;
+static pthread_mutex_t handle_owners_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handle_owners_cond = PTHREAD_COND_INITIALIZER;
+
+/* caml_enter_blocking_section runs signal handlers, that may raise. */
+static void enter_blocking_section_no_signal(void)
+{
+#if OCAML_VERSION >= 50000
+	caml_enter_blocking_section_no_pending();
+#else
+	caml_enter_blocking_section_hook();
+#endif
+}
+
+/* It should be called with handle_owners_mutex. */
+static bool is_owned_handle(iconv_t handle)
+{
+	for(struct handle_owner_s *i = handle_owners; i != NULL; i = i->next){
+		if(i->handle == handle){
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Own the handle of val_conv, waiting without the runtime lock while another
+   thread owns it.  Return false if it is closed or not opened yet.
+   val_conv should be registered as a local root. */
+static bool try_own_handle(struct handle_owner_s *owner, value const *val_conv)
+{
+	for(;;){
+		struct mliconv_t *internal = mliconv_val(*val_conv);
+		if(!has_handle(internal)){
+			return false;
+		}
+		iconv_t handle = internal->handle;
+		pthread_mutex_lock(&handle_owners_mutex);
+		bool owned = is_owned_handle(handle);
+		if(!owned){
+			owner->handle = handle;
+			owner->next = handle_owners;
+			handle_owners = owner;
+		}
+		pthread_mutex_unlock(&handle_owners_mutex);
+		if(!owned){
+			return true;
+		}
+		enter_blocking_section_no_signal();
+		pthread_mutex_lock(&handle_owners_mutex);
+		while(is_owned_handle(handle)){
+			pthread_cond_wait(&handle_owners_cond, &handle_owners_mutex);
+		}
+		pthread_mutex_unlock(&handle_owners_mutex);
+		caml_leave_blocking_section();
+		/* The handle may be closed meanwhile. */
+	}
+}
+
+static void own_handle(struct handle_owner_s *owner, value const *val_conv)
+{
+	while(!try_own_handle(owner, val_conv)){
+		/* raises if it is closed, or opens the deferred handle */
+		check_handle(val_conv);
+	}
+}
+
+static void disown_handle(struct handle_owner_s *owner)
+{
+	pthread_mutex_lock(&handle_owners_mutex);
+	struct handle_owner_s **i = &handle_owners;
+	while(*i != owner){
+		i = &(*i)->next;
+	}
+	*i = owner->next;
+	pthread_cond_broadcast(&handle_owners_cond);
+	pthread_mutex_unlock(&handle_owners_mutex);
+}
+
+static void normalize_code(char const *code, char *buf, size_t size);
+static int_least8_t lookup_cached_min_sequence(char const *fromcode);
+static int_least8_t get_native(char const *tocode, char const *fromcode);
+static struct table_s *get_table(char const *tocode, char const *fromcode);
 static bool get_unexist(struct mliconv_t *internal);
-static void set_unexist(struct mliconv_t *internal, bool ilseq);
+static bool set_unexist(struct mliconv_t *internal, bool ilseq);
 
 static void mliconv_finalize(value v);
 #if defined(SUPPORT_COMPARISON)
@@ -127,11 +369,23 @@ static struct custom_operations iconv_ops = {
 	.deserialize = custom_deserialize_default};
 #endif
 
+/* caml_alloc_custom_mem is added since OCaml 4.08 */
+
+static value alloc_mliconv(size_t to_len, size_t from_len)
+{
+	mlsize_t mem = sizeof(struct mliconv_t) + to_len + from_len + 2 + HANDLE_SIZE;
+#if OCAML_VERSION >= 40800
+	return caml_alloc_custom_mem(&iconv_ops, sizeof(struct mliconv_t), mem);
+#else
+	return caml_alloc_custom(&iconv_ops, sizeof(struct mliconv_t), mem, 0x1000000);
+#endif
+}
+
 static void mliconv_finalize(value v)
 {
 	CAMLparam1(v);
 	struct mliconv_t *internal = mliconv_val(v);
-	if(internal->handle != NULL){
+	if(has_handle(internal)){
 		iconv_close(internal->handle);
 	}
 	caml_stat_free(internal->tocode);
@@ -141,51 +395,82 @@ static void mliconv_finalize(value v)
 
 #if defined(SUPPORT_COMPARISON)
 
+/* The default substitute is not probed, so it is different from any
+   substitute set explicitly.  The result depends only on mliconv_t, not on
+   the probe cache, to be stable as a key. */
+
+static int compare_codes(char const *left, char const *right)
+{
+	char left_normalized[strlen(left) + 1];
+	char right_normalized[strlen(right) + 1];
+	normalize_code(left, left_normalized, sizeof(left_normalized));
+	normalize_code(right, right_normalized, sizeof(right_normalized));
+	return strcmp(left_normalized, right_normalized);
+}
+
 static int mliconv_compare(value v1, value v2)
 {
 	CAMLparam2(v1, v2);
 	struct mliconv_t *left_internal = mliconv_val(v1);
 	struct mliconv_t *right_internal = mliconv_val(v2);
-	int result = strcmp(left_internal->tocode, right_internal->tocode);
+	int result = compare_codes(left_internal->tocode, right_internal->tocode);
 	if(result == 0){
-		result = strcmp(left_internal->fromcode, right_internal->fromcode);
+		result = compare_codes(left_internal->fromcode, right_internal->fromcode);
+	}
+	if(result == 0){
+		result = left_internal->substitute_is_set - right_internal->substitute_is_set;
+	}
+	if(result == 0 && left_internal->substitute_is_set){
+		int_least8_t min_substitute_length =
+			(left_internal->substitute_length < right_internal->substitute_length) ?
+			left_internal->substitute_length :
+			right_internal->substitute_length;
+		result = memcmp(
+			left_internal->substitute, right_internal->substitute,
+			(size_t)min_substitute_length);
 		if(result == 0){
-			if(left_internal->substitute_length < 0){
-				get_substitute(
-					left_internal->tocode, left_internal->substitute,
-					&left_internal->substitute_length);
-			}
-			if(right_internal->substitute_length < 0){
-				get_substitute(
-					right_internal->tocode, right_internal->substitute,
-					&right_internal->substitute_length);
-			}
-			int_least8_t min_substitute_length =
-				(left_internal->substitute_length < right_internal->substitute_length) ?
-				left_internal->substitute_length :
-				right_internal->substitute_length;
-			result = memcmp(
-				left_internal->substitute, right_internal->substitute,
-				(size_t)min_substitute_length);
-			if(result == 0){
-				result = right_internal->substitute_length - left_internal->substitute_length;
-				if(result == 0){
-					bool left_unexist = get_unexist(left_internal);
-					bool right_unexist = get_unexist(right_internal);
-					result = right_unexist - left_unexist;
-				}
-			}
+			result = right_internal->substitute_length - left_internal->substitute_length;
 		}
 	}
+	if(result == 0){
+		result = right_internal->unexist - left_internal->unexist;
+	}
 	CAMLreturnT(int, result);
 }
 
+/* FNV-1a */
+
+#define FNV_OFFSET_BASIS 0x811c9dc5U
+#define FNV_PRIME 0x01000193U
+
+static uint32_t hash_bytes(uint32_t h, void const *p, size_t length)
+{
+	unsigned char const *q = p;
+	for(size_t i = 0; i < length; ++ i){
+		h = (h ^ q[i]) * FNV_PRIME;
+	}
+	return h;
+}
+
 static long mliconv_hash(value v)
 {
 	CAMLparam1(v);
 	struct mliconv_t *internal = mliconv_val(v);
-	long result = (strlen(internal->tocode) << 4) + strlen(internal->fromcode);
-	CAMLreturnT(long, result);
+	uint32_t h = FNV_OFFSET_BASIS;
+	char tocode[strlen(internal->tocode) + 1];
+	normalize_code(internal->tocode, tocode, sizeof(tocode));
+	h = hash_bytes(h, tocode, strlen(tocode) + 1);
+	char fromcode[strlen(internal->fromcode) + 1];
+	normalize_code(internal->fromcode, fromcode, sizeof(fromcode));
+	h = hash_bytes(h, fromcode, strlen(fromcode) + 1);
+	if(internal->substitute_is_set){
+		h = hash_bytes(h, &internal->substitute_length, 1);
+		h = hash_bytes(h, internal->substitute, internal->substitute_length);
+	}else{
+		h = hash_bytes(h, "\xff", 1);
+	}
+	h = hash_bytes(h, internal->unexist ? "\x01" : "\x00", 1);
+	CAMLreturnT(long, (long)h);
 }
 
 #endif
@@ -205,9 +490,13 @@ static void mliconv_serialize(
 	size_t from_len = strlen(internal->fromcode);
 	caml_serialize_int_4(from_len);
 	caml_serialize_block_1(internal->fromcode, from_len);
-	caml_serialize_int_1(internal->substitute_length);
-	if(internal->substitute_length > 0){
-		caml_serialize_block_1(internal->substitute, internal->substitute_length);
+	if(internal->substitute_is_set){
+		caml_serialize_int_1(internal->substitute_length);
+		if(internal->substitute_length > 0){
+			caml_serialize_block_1(internal->substitute, internal->substitute_length);
+		}
+	}else{
+		caml_serialize_int_1(-1);
 	}
 	caml_serialize_int_1(get_unexist(internal));
 	CAMLreturn0;
@@ -228,29 +517,80 @@ static unsigned long mliconv_deserialize(void *dst)
 	}
 	caml_deserialize_block_1(fromcode, from_len);
 	fromcode[from_len] = '\0';
+	/* iconv_open is deferred, since a marshalled graph may have many iconv_t
+	   that are never used. */
+	struct mliconv_t *internal = (struct mliconv_t *)dst;
+	internal->handle = DEFERRED_HANDLE;
+	internal->tocode = tocode;
+	internal->fromcode = fromcode;
+	internal->substitute_length = caml_deserialize_sint_1();
+	if(internal->substitute_length > 0){
+		caml_deserialize_block_1(internal->substitute, internal->substitute_length);
+	}
+	internal->substitute_is_set = internal->substitute_length >= 0;
+	internal->min_sequence_in_fromcode = lookup_cached_min_sequence(fromcode);
+	internal->native = 0; /* NATIVE_NONE */
+	internal->table = NULL;
+#if defined(SUPPORT_STATISTICS)
+	memset(&internal->stats, 0, sizeof(internal->stats));
+#endif
+	/* set to the handle by open_deferred_handle */
+	bool unexist = caml_deserialize_uint_1();
+#if !defined(_LIBICONV_VERSION) && defined(__FreeBSD__) && __FreeBSD__ >= 10
+	internal->unexist = unexist;
+#else
+	(void)unexist;
+	internal->unexist = UNEXIST_AFTER_OPEN;
+#endif
+	CAMLreturnT(unsigned long, sizeof(struct mliconv_t));
+}
+
+/* iconv_open and the probes are done without the runtime lock, with the names
+   copied to the stack since mliconv_t may be moved by GC.
+   val_conv should be registered as a local root. */
+static void open_deferred_handle(value const *val_conv)
+{
+	struct mliconv_t *internal = mliconv_val(*val_conv);
+	char tocode[strlen(internal->tocode) + 1];
+	strcpy(tocode, internal->tocode);
+	char fromcode[strlen(internal->fromcode) + 1];
+	strcpy(fromcode, internal->fromcode);
+	int_least8_t native = 0; /* NATIVE_NONE */
+	struct table_s *table = NULL;
+	caml_enter_blocking_section();
 	iconv_t handle = iconv_open(tocode, fromcode);
+	if(handle != (iconv_t)-1){
+		native = get_native(tocode, fromcode);
+		table = get_table(tocode, fromcode);
+	}
+	caml_leave_blocking_section();
+	internal = mliconv_val(*val_conv);
+	if(internal->handle != DEFERRED_HANDLE){
+		/* opened or closed by another thread meanwhile */
+		if(handle != (iconv_t)-1){
+			iconv_close(handle);
+		}
+		return;
+	}
 	if(handle == (iconv_t)-1){
-		char message[to_len + from_len + 128];
+		char message[strlen(tocode) + strlen(fromcode) + 128];
 		strcat(
 			strcat(
-				strcat(strcat(strcpy(message, __func__), ": failed iconv_open to "), tocode),
+				strcat(
+					strcat(strcpy(message, __func__), ": failed iconv_open to "),
+					tocode),
 				" from "),
 			fromcode);
-		caml_stat_free(tocode);
-		caml_stat_free(fromcode);
 		caml_failwith(message);
 	}
-	struct mliconv_t *internal = (struct mliconv_t *)dst;
 	internal->handle = handle;
-	internal->tocode = tocode;
-	internal->fromcode = fromcode;
-	internal->substitute_length = caml_deserialize_sint_1();
-	if(internal->substitute_length > 0){
-		caml_deserialize_block_1(internal->substitute, internal->substitute_length);
+	internal->native = native;
+	internal->table = table;
+	bool unexist = internal->unexist;
+	internal->unexist = UNEXIST_AFTER_OPEN;
+	if(unexist != UNEXIST_AFTER_OPEN && !set_unexist(internal, unexist)){
+		caml_failwith(__func__);
 	}
-	internal->min_sequence_in_fromcode = -1;
-	set_unexist(internal, caml_deserialize_uint_1());
-	CAMLreturnT(unsigned long, sizeof(struct mliconv_t));
 }
 
 /* setup */
@@ -262,6 +602,134 @@ __attribute__((constructor)) static void mliconv_register(void)
 
 #endif
 
+/* encoding names */
+
+static char const *canonicalize(char const *code)
+{
+#if !defined(__GNU_LIBRARY__) || defined(_LIBICONV_VERSION)
+	code = iconv_canonicalize(code);
+#endif
+	return code;
+}
+
+static void normalize_code(char const *code, char *buf, size_t size)
+{
+	/* uppercase and remove '-' and '_', "utf-16be" -> "UTF16BE" */
+	size_t i = 0;
+	while(*code != '\0' && i + 1 < size){
+		char c = *code ++;
+		if(c != '-' && c != '_'){
+			buf[i ++] = toupper((unsigned char)c);
+		}
+	}
+	buf[i] = '\0';
+}
+
+/* probe cache */
+
+/* The results of get_substitute and get_min_sequence_in_fromcode are shared
+   in the process, keyed by the normalized encoding name. */
+
+struct probe_cache_s {
+	struct probe_cache_s *next;
+	char substitute[MAX_SEQUENCE];
+	int_least8_t substitute_length; /* -1 if not probed */
+	int_least8_t min_sequence; /* -1 if not probed */
+	char code[];
+};
+
+static struct probe_cache_s *probe_cache = NULL;
+static pthread_mutex_t probe_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* It should be called with probe_cache_mutex. */
+static struct probe_cache_s *find_probe_cache(char const *normalized)
+{
+	struct probe_cache_s *entry = probe_cache;
+	while(entry != NULL && strcmp(entry->code, normalized) != 0){
+		entry = entry->next;
+	}
+	return entry;
+}
+
+/* It should be called with probe_cache_mutex. */
+static struct probe_cache_s *add_probe_cache(char const *normalized)
+{
+	struct probe_cache_s *entry = find_probe_cache(normalized);
+	if(entry == NULL){
+		size_t code_len = strlen(normalized);
+		entry = malloc(sizeof(struct probe_cache_s) + code_len + 1);
+		if(entry != NULL){
+			entry->substitute_length = -1;
+			entry->min_sequence = -1;
+			memcpy(entry->code, normalized, code_len + 1);
+			entry->next = probe_cache;
+			probe_cache = entry;
+		}
+	}
+	return entry;
+}
+
+static bool lookup_cached_substitute(
+	char const *tocode, char *substitute, int_least8_t *substitute_length)
+{
+	bool result = false;
+	size_t to_len = strlen(tocode);
+	char normalized[to_len + 1];
+	normalize_code(tocode, normalized, to_len + 1);
+	pthread_mutex_lock(&probe_cache_mutex);
+	struct probe_cache_s *entry = find_probe_cache(normalized);
+	if(entry != NULL && entry->substitute_length >= 0){
+		memcpy(substitute, entry->substitute, entry->substitute_length);
+		*substitute_length = entry->substitute_length;
+		result = true;
+	}
+	pthread_mutex_unlock(&probe_cache_mutex);
+	return result;
+}
+
+static void cache_substitute(
+	char const *tocode, char const *substitute, int_least8_t substitute_length)
+{
+	size_t to_len = strlen(tocode);
+	char normalized[to_len + 1];
+	normalize_code(tocode, normalized, to_len + 1);
+	pthread_mutex_lock(&probe_cache_mutex);
+	struct probe_cache_s *entry = add_probe_cache(normalized);
+	if(entry != NULL){
+		memcpy(entry->substitute, substitute, substitute_length);
+		entry->substitute_length = substitute_length;
+	}
+	pthread_mutex_unlock(&probe_cache_mutex);
+}
+
+static int_least8_t lookup_cached_min_sequence(char const *fromcode)
+{
+	int_least8_t result = -1;
+	size_t from_len = strlen(fromcode);
+	char normalized[from_len + 1];
+	normalize_code(fromcode, normalized, from_len + 1);
+	pthread_mutex_lock(&probe_cache_mutex);
+	struct probe_cache_s *entry = find_probe_cache(normalized);
+	if(entry != NULL){
+		result = entry->min_sequence;
+	}
+	pthread_mutex_unlock(&probe_cache_mutex);
+	return result;
+}
+
+static void cache_min_sequence(char const *fromcode, int_least8_t min_sequence)
+{
+	size_t from_len = strlen(fromcode);
+	char normalized[from_len + 1];
+	normalize_code(fromcode, normalized, from_len + 1);
+	pthread_mutex_lock(&probe_cache_mutex);
+	struct probe_cache_s *entry = add_probe_cache(normalized);
+	if(entry != NULL){
+		entry->min_sequence = min_sequence;
+	}
+	pthread_mutex_unlock(&probe_cache_mutex);
+}
+
 static int convert_one_sequence(
 	char const *tocode,
 	char const *fromcode,
@@ -291,47 +759,46 @@ static int convert_one_sequence(
 
 static char latin1[] = "ISO-8859-1";
 
+/* probes is incremented if it is not cached. */
 static void get_substitute(
-	char const *tocode, char *substitute, int_least8_t *substitute_length)
+	char const *tocode, char *substitute, int_least8_t *substitute_length,
+	uint64_t *probes)
 {
-	char *d = substitute;
-	size_t d_len = MAX_SEQUENCE;
-	if(convert_one_sequence(tocode, latin1, '?', &d, &d_len) < 0){
-		/* error case */
-		substitute[0] = '?';
-		*substitute_length = 1;
-	}else{
-		*substitute_length = MAX_SEQUENCE - d_len;
+	if(!lookup_cached_substitute(tocode, substitute, substitute_length)){
+		++ *probes;
+		char *d = substitute;
+		size_t d_len = MAX_SEQUENCE;
+		if(convert_one_sequence(tocode, latin1, '?', &d, &d_len) < 0){
+			/* error case */
+			substitute[0] = '?';
+			*substitute_length = 1;
+		}else{
+			*substitute_length = MAX_SEQUENCE - d_len;
+		}
+		cache_substitute(tocode, substitute, *substitute_length);
 	}
 }
 
-static bool get_unexist(
-	__attribute__((unused)) struct mliconv_t *internal)
+/* The setting is kept in mliconv_t not to query the handle. */
+static bool get_unexist(struct mliconv_t *internal)
 {
-	bool result;
-#if !defined(_LIBICONV_VERSION) && defined(__FreeBSD__) && __FreeBSD__ >= 10
-	int arg;
-	if(iconvctl(internal->handle, ICONV_GET_ILSEQ_INVALID, &arg) < 0){
-		caml_failwith(__func__);
-	}else{
-		result = arg;
-	}
-#else
-	result = true;
-#endif
-	return result;
+	return internal->unexist;
 }
 
-static void set_unexist(
+/* It returns false if failed, without raising since the handle should be
+   owned. */
+static bool set_unexist(
 	__attribute__((unused)) struct mliconv_t *internal,
 	__attribute__((unused)) bool ilseq)
 {
 #if !defined(_LIBICONV_VERSION) && defined(__FreeBSD__) && __FreeBSD__ >= 10
 	int arg = ilseq;
 	if(iconvctl(internal->handle, ICONV_SET_ILSEQ_INVALID, &arg) < 0){
-		caml_failwith(__func__);
+		return false;
 	}
+	internal->unexist = ilseq;
 #endif
+	return true;
 }
 
 static int put_substitute(
@@ -361,9 +828,16 @@ static int put_substitute(
 	return result;
 }
 
-static int_least8_t get_min_sequence_in_fromcode(char const *fromcode)
+/* probes is incremented if it is not cached. */
+static int_least8_t get_min_sequence_in_fromcode(
+	char const *fromcode, uint64_t *probes)
 {
-	int_least8_t min_sequence_in_fromcode;
+	int_least8_t min_sequence_in_fromcode =
+		lookup_cached_min_sequence(fromcode);
+	if(min_sequence_in_fromcode >= 0){
+		return min_sequence_in_fromcode;
+	}
+	++ *probes;
 	char outbuffer[MAX_SEQUENCE];
 	char *d = outbuffer;
 	size_t d_len = MAX_SEQUENCE;
@@ -380,6 +854,7 @@ static int_least8_t get_min_sequence_in_fromcode(char const *fromcode)
 		size_t used = MAX_SEQUENCE - d_len;
 		min_sequence_in_fromcode = (used > 0) ? used : 1;
 	}
+	cache_min_sequence(fromcode, min_sequence_in_fromcode);
 	return min_sequence_in_fromcode;
 }
 
@@ -395,369 +870,3447 @@ static void skip_min_sequence(
 	}
 }
 
-/* version functions */
+/* scratch buffer */
 
-CAMLprim value mliconv_get_version_opt(value val_unit)
+static size_t get_code_unit(char const *code)
 {
-	CAMLparam1(val_unit);
-#if defined(_LIBICONV_VERSION)
-	CAMLlocal2(val_result, val_tuple);
-	int version = _libiconv_version;
-	val_tuple = caml_alloc_tuple(2);
-	Store_field(val_tuple, 0, Val_int(version >> 8)); /* major */
-	Store_field(val_tuple, 1, Val_int(version & 0xFF)); /* minor */
-	val_result = caml_alloc_small(1, Tag_some);
-	Store_field(val_result, 0, val_tuple);
-#else
-	CAMLlocal1(val_result);
-	val_result = Val_none;
-#endif
-	CAMLreturn(val_result);
+	char normalized[16];
+	normalize_code(code, normalized, sizeof(normalized));
+	size_t result;
+	if(strncmp(normalized, "UTF16", 5) == 0 || strncmp(normalized, "UCS2", 4) == 0){
+		result = 2;
+	}else if(
+		strncmp(normalized, "UTF32", 5) == 0 || strncmp(normalized, "UCS4", 4) == 0)
+	{
+		result = 4;
+	}else{
+		result = 1;
+	}
+	return result;
 }
 
-/* open and setting functions */
+static size_t estimate_length(
+	char const *tocode, char const *fromcode, size_t s_len)
+{
+	size_t to_unit = get_code_unit(tocode);
+	size_t from_unit = get_code_unit(fromcode);
+	return s_len / from_unit * to_unit + s_len % from_unit + MAX_SEQUENCE;
+}
 
-CAMLprim value mliconv_open(value val_tocode, value val_fromcode)
+struct scratch_s {
+	char *buf;
+	size_t capacity;
+};
+
+static bool init_scratch(struct scratch_s *scratch, size_t capacity)
 {
-	CAMLparam2(val_tocode, val_fromcode);
-	CAMLlocal1(val_result);
-	/* Do caml_alloc_custom at first because _noexc-version does not exist. */
-	val_result = caml_alloc_custom(&iconv_ops, sizeof(struct mliconv_t), 0, 1);
-	struct mliconv_t *internal = mliconv_val(val_result);
-	internal->handle = NULL;
-	internal->tocode = NULL;
-	internal->fromcode = NULL;
-	const char *tocode = String_val(val_tocode);
+	scratch->buf = caml_stat_alloc_noexc(capacity);
+	scratch->capacity = capacity;
+	return scratch->buf != NULL;
+}
+
+/* Enlarge the scratch buffer by the ratio of the already converted part. */
+static bool grow_scratch(
+	struct scratch_s *scratch, size_t consumed, size_t inbytesleft,
+	struct iconv_field_s *out)
+{
+	size_t used = out->buf - scratch->buf;
+	size_t increment = (consumed > 0 && used > 0) ?
+		inbytesleft / consumed * used + inbytesleft % consumed * used / consumed :
+		scratch->capacity;
+	increment += MAX_SEQUENCE;
+	if(increment < scratch->capacity / 4){
+		increment = scratch->capacity / 4;
+	}
+	size_t new_capacity = scratch->capacity + increment;
+	char *new_buf = caml_stat_resize_noexc(scratch->buf, new_capacity);
+	if(new_buf == NULL){
+		return false;
+	}
+	scratch->buf = new_buf;
+	scratch->capacity = new_capacity;
+	out->buf = new_buf + used;
+	out->bytesleft = new_capacity - used;
+	return true;
+}
+
+static bool grow_scratch_to(struct scratch_s *scratch, size_t new_capacity)
+{
+	char *new_buf = caml_stat_resize_noexc(scratch->buf, new_capacity);
+	if(new_buf == NULL){
+		return false;
+	}
+	scratch->buf = new_buf;
+	scratch->capacity = new_capacity;
+	return true;
+}
+
+static void done_scratch(struct scratch_s *scratch)
+{
+	caml_stat_free(scratch->buf);
+}
+
+/* substitution report */
+
+/* The offsets of the substituted sequences are recorded into the C buffer,
+   and written back to substitution_report after the conversion.
+   The offset is (the pointer - base + origin), and the base should be updated
+   when the buffer is moved. */
+struct report_s {
+	size_t count; /* including the previous calls */
+	size_t first; /* the count before this call */
+	size_t capacity;
+	ptrdiff_t *offsets; /* pairs of the input and output offsets */
+	char const *in_base;
+	ptrdiff_t in_origin;
+	char const *out_base;
+	ptrdiff_t out_origin;
+};
+
+/* It sets NULL for None.  It returns false if out of memory, without raising
+   since it is used with the handle owned. */
+static bool init_report(
+	struct report_s **result, struct report_s *report, value val_report)
+{
+	*result = NULL;
+	if(val_report == Val_none){
+		return true;
+	}
+	value val_r = Field(val_report, 0);
+	report->count = Long_val(Field(val_r, 0));
+	report->first = report->count;
+	size_t in_capacity = Wosize_val(Field(val_r, 1));
+	size_t out_capacity = Wosize_val(Field(val_r, 2));
+	report->capacity = (in_capacity < out_capacity) ? in_capacity : out_capacity;
+	report->offsets = NULL;
+	if(report->first < report->capacity){
+		report->offsets = caml_stat_alloc_noexc(
+			(report->capacity - report->first) * 2 * sizeof(ptrdiff_t));
+		if(report->offsets == NULL){
+			return false;
+		}
+	}
+	report->in_base = NULL;
+	report->in_origin = 0;
+	report->out_base = NULL;
+	report->out_origin = 0;
+	*result = report;
+	return true;
+}
+
+static void record_substitution(
+	struct report_s *report, char const *inbuf, char const *outbuf)
+{
+	if(report->count < report->capacity){
+		ptrdiff_t *pair = report->offsets + (report->count - report->first) * 2;
+		pair[0] = inbuf - report->in_base + report->in_origin;
+		pair[1] = outbuf - report->out_base + report->out_origin;
+	}
+	++ report->count;
+}
+
+static void done_report(struct report_s *report)
+{
+	if(report != NULL){
+		caml_stat_free(report->offsets);
+	}
+}
+
+static void store_report(value val_report, struct report_s *report)
+{
+	if(report != NULL){
+		value val_r = Field(val_report, 0);
+		Store_field(val_r, 0, Val_long(report->count));
+		size_t end = (report->count < report->capacity) ?
+			report->count : report->capacity;
+		for(size_t i = report->first; i < end; ++ i){
+			ptrdiff_t const *pair = report->offsets + (i - report->first) * 2;
+			Store_field(Field(val_r, 1), i, Val_long(pair[0]));
+			Store_field(Field(val_r, 2), i, Val_long(pair[1]));
+		}
+		done_report(report);
+	}
+}
+
+/* native conversion */
+
+/* Conversions between Unicode encodings, ISO-8859-1 and ASCII are done
+   without iconv.  They should return the same results as glibc. */
+
+#if defined(__GNU_LIBRARY__) && !defined(_LIBICONV_VERSION)
+#define SUPPORT_NATIVE
+#endif
+
+enum {
+	NATIVE_NONE,
+	/* ASCII compatible single-byte encodings */
+	NATIVE_ASCII,
+	NATIVE_LATIN1,
+	NATIVE_UTF8,
+	/* wide encodings */
+	NATIVE_UTF16BE,
+	NATIVE_UTF16LE,
+	NATIVE_UTF32BE,
+	NATIVE_UTF32LE
+};
+
+#define NATIVE_PAIR(to, from) (((from) << 4) | (to))
+#define NATIVE_FROM(native) ((native) >> 4)
+#define NATIVE_TO(native) ((native) & 0x0f)
+
+static int get_native_encoding(char const *code)
+{
+	static struct {
+		char name[16];
+		int encoding;
+	} const table[] = {
+		{"ANSIX3.41968", NATIVE_ASCII},
+		{"ASCII", NATIVE_ASCII},
+		{"USASCII", NATIVE_ASCII},
+		{"ISO88591", NATIVE_LATIN1},
+		{"LATIN1", NATIVE_LATIN1},
+		{"UTF8", NATIVE_UTF8},
+		{"UTF16BE", NATIVE_UTF16BE},
+		{"UTF16LE", NATIVE_UTF16LE},
+		{"UTF32BE", NATIVE_UTF32BE},
+		{"UTF32LE", NATIVE_UTF32LE}
+	};
+	char normalized[sizeof(table[0].name)];
+	if(strlen(code) >= sizeof(normalized)){
+		return NATIVE_NONE; /* including "//TRANSLIT" or "//IGNORE" */
+	}
+	normalize_code(code, normalized, sizeof(normalized));
+	for(size_t i = 0; i < sizeof(table) / sizeof(table[0]); ++ i){
+		if(strcmp(normalized, table[i].name) == 0){
+			return table[i].encoding;
+		}
+	}
+	return NATIVE_NONE;
+}
+
+static int_least8_t get_native(
+	__attribute__((unused)) char const *tocode,
+	__attribute__((unused)) char const *fromcode)
+{
+	int_least8_t result = NATIVE_NONE;
+#if defined(SUPPORT_NATIVE)
+	int to = get_native_encoding(tocode);
+	int from = get_native_encoding(fromcode);
+	if(to != NATIVE_NONE && from != NATIVE_NONE){
+		result = NATIVE_PAIR(to, from);
+	}
+#endif
+	return result;
+}
+
+static inline __attribute__((always_inline)) size_t get_native_unit(
+	int encoding)
+{
+	return (encoding >= NATIVE_UTF32BE) ? 4 : (encoding >= NATIVE_UTF16BE) ? 2 : 1;
+}
+
+/* Return the length of the leading bytes less than 0x80. */
+static size_t ascii_run(unsigned char const *s, size_t s_len)
+{
+	size_t i = 0;
+#if defined(__SSE2__)
+	while(i + 16 <= s_len){
+		int mask = _mm_movemask_epi8(_mm_loadu_si128((__m128i const *)(s + i)));
+		if(mask != 0){
+			return i + __builtin_ctz(mask);
+		}
+		i += 16;
+	}
+#else
+	while(i + 8 <= s_len){
+		uint64_t word;
+		memcpy(&word, s + i, 8);
+		if((word & UINT64_C(0x8080808080808080)) != 0){
+			break;
+		}
+		i += 8;
+	}
+#endif
+	while(i < s_len && s[i] < 0x80){
+		++ i;
+	}
+	return i;
+}
+
+static inline __attribute__((always_inline)) uint32_t get_native_unit_value(
+	int encoding, unsigned char const *s)
+{
+	switch(encoding){
+	case NATIVE_UTF16BE:
+		return ((uint32_t)s[0] << 8) | s[1];
+	case NATIVE_UTF16LE:
+		return ((uint32_t)s[1] << 8) | s[0];
+	case NATIVE_UTF32BE:
+		return
+			((uint32_t)s[0] << 24) | ((uint32_t)s[1] << 16) | ((uint32_t)s[2] << 8)
+			| s[3];
+	case NATIVE_UTF32LE:
+		return
+			((uint32_t)s[3] << 24) | ((uint32_t)s[2] << 16) | ((uint32_t)s[1] << 8)
+			| s[0];
+	default:
+		return s[0];
+	}
+}
+
+static inline __attribute__((always_inline)) void put_native_unit_value(
+	int encoding, uint32_t code, unsigned char *d)
+{
+	switch(encoding){
+	case NATIVE_UTF16BE:
+		d[0] = code >> 8;
+		d[1] = code;
+		break;
+	case NATIVE_UTF16LE:
+		d[0] = code;
+		d[1] = code >> 8;
+		break;
+	case NATIVE_UTF32BE:
+		d[0] = code >> 24;
+		d[1] = code >> 16;
+		d[2] = code >> 8;
+		d[3] = code;
+		break;
+	case NATIVE_UTF32LE:
+		d[0] = code;
+		d[1] = code >> 8;
+		d[2] = code >> 16;
+		d[3] = code >> 24;
+		break;
+	default:
+		d[0] = code;
+	}
+}
+
+/* Copy the leading characters less than 0x80, and return the number of them.
+   The switch is hoisted out of the loops from single-byte encodings to be
+   vectorized. */
+static inline __attribute__((always_inline)) size_t copy_ascii_run(
+	int from, int to, unsigned char const *s, size_t s_len, unsigned char *d,
+	size_t d_len)
+{
+	size_t from_unit = get_native_unit(from);
+	size_t to_unit = get_native_unit(to);
+	size_t limit = s_len / from_unit;
+	if(limit > d_len / to_unit){
+		limit = d_len / to_unit;
+	}
+	size_t n;
+	if(from_unit == 1){
+		n = ascii_run(s, limit);
+		switch(to){
+		case NATIVE_UTF16BE:
+			for(size_t i = 0; i < n; ++ i){
+				d[i * 2] = 0;
+				d[i * 2 + 1] = s[i];
+			}
+			break;
+		case NATIVE_UTF16LE:
+			for(size_t i = 0; i < n; ++ i){
+				d[i * 2] = s[i];
+				d[i * 2 + 1] = 0;
+			}
+			break;
+		case NATIVE_UTF32BE:
+			for(size_t i = 0; i < n; ++ i){
+				d[i * 4] = 0;
+				d[i * 4 + 1] = 0;
+				d[i * 4 + 2] = 0;
+				d[i * 4 + 3] = s[i];
+			}
+			break;
+		case NATIVE_UTF32LE:
+			for(size_t i = 0; i < n; ++ i){
+				d[i * 4] = s[i];
+				d[i * 4 + 1] = 0;
+				d[i * 4 + 2] = 0;
+				d[i * 4 + 3] = 0;
+			}
+			break;
+		default:
+			memcpy(d, s, n);
+		}
+	}else{
+		n = 0;
+		while(n < limit){
+			uint32_t code = get_native_unit_value(from, s + n * from_unit);
+			if(code >= 0x80){
+				break;
+			}
+			put_native_unit_value(to, code, d + n * to_unit);
+			++ n;
+		}
+	}
+	return n;
+}
+
+/* Return the length of the sequence, or -EILSEQ or -EINVAL. */
+static inline __attribute__((always_inline)) int decode_native(
+	int encoding, unsigned char const *s, size_t s_len, uint32_t *code)
+{
+	switch(encoding){
+	case NATIVE_ASCII:
+		if(s[0] >= 0x80){
+			return -EILSEQ;
+		}
+		*code = s[0];
+		return 1;
+	case NATIVE_LATIN1:
+		*code = s[0];
+		return 1;
+	case NATIVE_UTF8:
+		{
+			/* Like glibc, 5 and 6 bytes sequences are decoded. */
+			unsigned char lead = s[0];
+			int length;
+			uint32_t c;
+			uint32_t min;
+			if(lead < 0x80){
+				*code = lead;
+				return 1;
+			}else if(lead < 0xc2){
+				return -EILSEQ;
+			}else if(lead < 0xe0){
+				length = 2;
+				c = lead & 0x1f;
+				min = 0x80;
+			}else if(lead < 0xf0){
+				length = 3;
+				c = lead & 0x0f;
+				min = 0x800;
+			}else if(lead < 0xf8){
+				length = 4;
+				c = lead & 0x07;
+				min = 0x10000;
+			}else if(lead < 0xfc){
+				length = 5;
+				c = lead & 0x03;
+				min = 0x200000;
+			}else if(lead < 0xfe){
+				length = 6;
+				c = lead & 0x01;
+				min = 0x4000000;
+			}else{
+				return -EILSEQ;
+			}
+			int i = 1;
+			while(i < length && (size_t)i < s_len && (s[i] & 0xc0) == 0x80){
+				c = (c << 6) | (s[i] & 0x3f);
+				++ i;
+			}
+			if(i < length){
+				return ((size_t)i == s_len) ? -EINVAL : -EILSEQ;
+			}
+			if(c < min || (c >= 0xd800 && c < 0xe000)){
+				return -EILSEQ;
+			}
+			*code = c;
+			return length;
+		}
+	case NATIVE_UTF16BE:
+	case NATIVE_UTF16LE:
+		{
+			if(s_len < 2){
+				return -EINVAL;
+			}
+			uint32_t c = get_native_unit_value(encoding, s);
+			if(c >= 0xdc00 && c < 0xe000){
+				return -EILSEQ;
+			}else if(c >= 0xd800 && c < 0xdc00){
+				if(s_len < 4){
+					return -EINVAL;
+				}
+				uint32_t c2 = get_native_unit_value(encoding, s + 2);
+				if(c2 < 0xdc00 || c2 >= 0xe000){
+					return -EILSEQ;
+				}
+				*code = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+				return 4;
+			}
+			*code = c;
+			return 2;
+		}
+	default: /* NATIVE_UTF32BE, NATIVE_UTF32LE */
+		{
+			if(s_len < 4){
+				return -EINVAL;
+			}
+			uint32_t c = get_native_unit_value(encoding, s);
+			if(c > 0x10ffff || (c >= 0xd800 && c < 0xe000)){
+				return -EILSEQ;
+			}
+			*code = c;
+			return 4;
+		}
+	}
+}
+
+/* Return the length of the sequence, or -E2BIG or -EILSEQ.
+   Like glibc, the space for one unit is checked at first, and the tag
+   characters are ignored in non-Unicode encodings. */
+static inline __attribute__((always_inline)) int encode_native(
+	int encoding, uint32_t code, unsigned char *d, size_t d_len)
+{
+	if(d_len < get_native_unit(encoding)){
+		return -E2BIG;
+	}
+	switch(encoding){
+	case NATIVE_ASCII:
+	case NATIVE_LATIN1:
+		if(code >= (encoding == NATIVE_ASCII ? 0x80 : 0x100)){
+			return ((code >> 7) == (0xe0000 >> 7)) ? 0 : -EILSEQ;
+		}
+		d[0] = code;
+		return 1;
+	case NATIVE_UTF8:
+		{
+			/* glibc writes also the code points over 0x10ffff. */
+			int length =
+				(code < 0x80) ? 1 :
+				(code < 0x800) ? 2 :
+				(code < 0x10000) ? 3 :
+				(code < 0x200000) ? 4 :
+				(code < 0x4000000) ? 5 :
+				6;
+			if(d_len < (size_t)length){
+				return -E2BIG;
+			}
+			if(length == 1){
+				d[0] = code;
+			}else{
+				for(int i = length - 1; i > 0; -- i){
+					d[i] = 0x80 | (code & 0x3f);
+					code >>= 6;
+				}
+				d[0] = (0xff00 >> length) | code;
+			}
+			return length;
+		}
+	case NATIVE_UTF16BE:
+	case NATIVE_UTF16LE:
+		if(code < 0x10000){
+			put_native_unit_value(encoding, code, d);
+			return 2;
+		}else if(code < 0x110000){
+			if(d_len < 4){
+				return -E2BIG;
+			}
+			code -= 0x10000;
+			put_native_unit_value(encoding, 0xd800 | (code >> 10), d);
+			put_native_unit_value(encoding, 0xdc00 | (code & 0x3ff), d + 2);
+			return 4;
+		}else{
+			return -EILSEQ;
+		}
+	default: /* NATIVE_UTF32BE, NATIVE_UTF32LE */
+		if(code >= 0x110000){
+			return -EILSEQ;
+		}
+		put_native_unit_value(encoding, code, d);
+		return 4;
+	}
+}
+
+/* It is expanded for each pair of constant encodings. */
+static inline __attribute__((always_inline)) size_t native_iconv_loop(
+	int from, int to, char **inbuf, size_t *inbytesleft, char **outbuf,
+	size_t *outbytesleft)
+{
+	unsigned char const *s = (unsigned char *)*inbuf;
+	size_t s_len = *inbytesleft;
+	unsigned char *d = (unsigned char *)*outbuf;
+	size_t d_len = *outbytesleft;
+	size_t result = 0;
+	size_t from_unit = get_native_unit(from);
+	size_t to_unit = get_native_unit(to);
+	while(s_len > 0){
+		if(s_len >= from_unit && get_native_unit_value(from, s) < 0x80){
+			size_t n = copy_ascii_run(from, to, s, s_len, d, d_len);
+			s += n * from_unit;
+			s_len -= n * from_unit;
+			d += n * to_unit;
+			d_len -= n * to_unit;
+			if(s_len == 0){
+				break;
+			}
+		}
+		uint32_t code;
+		int s_used = decode_native(from, s, s_len, &code);
+		if(s_used < 0){
+			errno = -s_used;
+			result = (size_t)-1;
+			break;
+		}
+		int d_used = encode_native(to, code, d, d_len);
+		if(d_used < 0){
+			errno = -d_used;
+			result = (size_t)-1;
+			break;
+		}
+		s += s_used;
+		s_len -= s_used;
+		d += d_used;
+		d_len -= d_used;
+	}
+	*inbuf = (char *)s;
+	*inbytesleft = s_len;
+	*outbuf = (char *)d;
+	*outbytesleft = d_len;
+	return result;
+}
+
+static inline __attribute__((always_inline)) size_t native_iconv_to(
+	int from, int to, char **inbuf, size_t *inbytesleft, char **outbuf,
+	size_t *outbytesleft)
+{
+	switch(to){
+	case NATIVE_ASCII:
+		return native_iconv_loop(
+			from, NATIVE_ASCII, inbuf, inbytesleft, outbuf, outbytesleft);
+	case NATIVE_LATIN1:
+		return native_iconv_loop(
+			from, NATIVE_LATIN1, inbuf, inbytesleft, outbuf, outbytesleft);
+	case NATIVE_UTF8:
+		return native_iconv_loop(
+			from, NATIVE_UTF8, inbuf, inbytesleft, outbuf, outbytesleft);
+	case NATIVE_UTF16BE:
+		return native_iconv_loop(
+			from, NATIVE_UTF16BE, inbuf, inbytesleft, outbuf, outbytesleft);
+	case NATIVE_UTF16LE:
+		return native_iconv_loop(
+			from, NATIVE_UTF16LE, inbuf, inbytesleft, outbuf, outbytesleft);
+	case NATIVE_UTF32BE:
+		return native_iconv_loop(
+			from, NATIVE_UTF32BE, inbuf, inbytesleft, outbuf, outbytesleft);
+	default:
+		return native_iconv_loop(
+			from, NATIVE_UTF32LE, inbuf, inbytesleft, outbuf, outbytesleft);
+	}
+}
+
+/* Same as iconv(3). */
+static size_t native_iconv(
+	int_least8_t native, char **inbuf, size_t *inbytesleft, char **outbuf,
+	size_t *outbytesleft)
+{
+	int to = NATIVE_TO(native);
+	switch(NATIVE_FROM(native)){
+	case NATIVE_ASCII:
+		return native_iconv_to(
+			NATIVE_ASCII, to, inbuf, inbytesleft, outbuf, outbytesleft);
+	case NATIVE_LATIN1:
+		return native_iconv_to(
+			NATIVE_LATIN1, to, inbuf, inbytesleft, outbuf, outbytesleft);
+	case NATIVE_UTF8:
+		return native_iconv_to(
+			NATIVE_UTF8, to, inbuf, inbytesleft, outbuf, outbytesleft);
+	case NATIVE_UTF16BE:
+		return native_iconv_to(
+			NATIVE_UTF16BE, to, inbuf, inbytesleft, outbuf, outbytesleft);
+	case NATIVE_UTF16LE:
+		return native_iconv_to(
+			NATIVE_UTF16LE, to, inbuf, inbytesleft, outbuf, outbytesleft);
+	case NATIVE_UTF32BE:
+		return native_iconv_to(
+			NATIVE_UTF32BE, to, inbuf, inbytesleft, outbuf, outbytesleft);
+	default:
+		return native_iconv_to(
+			NATIVE_UTF32LE, to, inbuf, inbytesleft, outbuf, outbytesleft);
+	}
+}
+
+/* single-byte tables */
+
+/* A conversion from a stateless single-byte encoding is learned by probing
+   all bytes once, and done by looking up the table.
+   Citrus iconv is excluded because its result depends on unexist. */
+
+#if !(!defined(_LIBICONV_VERSION) && defined(__FreeBSD__) && __FreeBSD__ >= 10)
+#define SUPPORT_TABLE
+#endif
+
+#define MAX_TABLE_SEQUENCE 4
+
+struct table_s {
+	/* the length of output, or 0 if the byte is illegal or does not exist in
+	   tocode */
+	uint8_t length[256];
+	/* E2BIG instead of EILSEQ for the illegal byte if the output is smaller */
+	uint8_t space[256];
+	uint8_t sequence[256][MAX_TABLE_SEQUENCE];
+	bool single; /* all lengths are 0 or 1 */
+};
+
+struct table_cache_s {
+	struct table_cache_s *next;
+	struct table_s *table; /* NULL if it is not a single-byte conversion */
+	char *fromcode; /* in the same block */
+	char tocode[];
+};
+
+static struct table_cache_s *table_cache = NULL;
+static pthread_mutex_t table_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool lookup_cached_table(
+	char const *tocode, char const *fromcode, struct table_s **table)
+{
+	bool result = false;
+	pthread_mutex_lock(&table_cache_mutex);
+	struct table_cache_s *entry = table_cache;
+	while(entry != NULL){
+		if(strcmp(entry->tocode, tocode) == 0 && strcmp(entry->fromcode, fromcode) == 0){
+			*table = entry->table;
+			result = true;
+			break;
+		}
+		entry = entry->next;
+	}
+	pthread_mutex_unlock(&table_cache_mutex);
+	return result;
+}
+
+/* The table is never freed once it is cached. */
+static void cache_table(
+	char const *tocode, char const *fromcode, struct table_s *table)
+{
+	size_t to_len = strlen(tocode);
+	size_t from_len = strlen(fromcode);
+	struct table_cache_s *entry =
+		malloc(sizeof(struct table_cache_s) + to_len + from_len + 2);
+	if(entry != NULL){
+		entry->table = table;
+		memcpy(entry->tocode, tocode, to_len + 1);
+		entry->fromcode = entry->tocode + to_len + 1;
+		memcpy(entry->fromcode, fromcode, from_len + 1);
+		pthread_mutex_lock(&table_cache_mutex);
+		entry->next = table_cache;
+		table_cache = entry;
+		pthread_mutex_unlock(&table_cache_mutex);
+	}else{
+		free(table);
+	}
+}
+
+/* Convert one byte from the initial state, and return the errno or 0. */
+static int probe_byte(
+	iconv_t handle, unsigned char c, size_t space, char *out, size_t *out_len)
+{
+	int result = 0;
+	iconv(handle, NULL, NULL, NULL, NULL);
+	char in = c;
+	char *s = &in;
+	size_t s_len = 1;
+	char *d = out;
+	size_t d_len = space;
+	if(iconv(handle, &s, &s_len, &d, &d_len) == (size_t)-1){
+		result = errno;
+		if(s_len != 1 || d != out){
+			result = -1; /* it skips or writes something like //IGNORE */
+		}
+	}else if(iconv(handle, NULL, NULL, &d, &d_len) == (size_t)-1){
+		result = -1;
+	}
+	*out_len = d - out;
+	return result;
+}
+
+/* It calls iconv_open, so it should be used without the runtime lock. */
+static struct table_s *make_table(char const *tocode, char const *fromcode)
+{
+	iconv_t handle = iconv_open(tocode, fromcode);
+	if(handle == (iconv_t)-1){
+		return NULL;
+	}
+	struct table_s *table = malloc(sizeof(struct table_s));
+	char legal[256];
+	size_t legal_length = 0;
+	char expected[256 * MAX_TABLE_SEQUENCE];
+	size_t expected_length = 0;
+	if(table == NULL){
+		goto not_table;
+	}
+	table->single = true;
+	for(int c = 0; c < 256; ++ c){
+		char out[MAX_SEQUENCE];
+		size_t out_len;
+		int e = probe_byte(handle, c, MAX_SEQUENCE, out, &out_len);
+		if(e == EILSEQ){
+			table->length[c] = 0;
+			size_t space = 0;
+			while(probe_byte(handle, c, space, out, &out_len) == E2BIG){
+				if(++ space > MAX_TABLE_SEQUENCE){
+					goto not_table;
+				}
+			}
+			table->space[c] = space;
+		}else if(e == 0 && out_len > 0 && out_len <= MAX_TABLE_SEQUENCE){
+			/* out_len = 0 means that the byte changes the shift state */
+			table->length[c] = out_len;
+			table->space[c] = 0;
+			memcpy(table->sequence[c], out, out_len);
+			if(out_len > 1){
+				table->single = false;
+			}
+			legal[legal_length ++] = c;
+			memcpy(expected + expected_length, out, out_len);
+			expected_length += out_len;
+		}else{
+			goto not_table; /* a lead byte of multi-byte encoding, or others */
+		}
+	}
+	/* Confirm that tocode is also stateless. */
+	iconv(handle, NULL, NULL, NULL, NULL);
+	char actual[256 * MAX_TABLE_SEQUENCE + MAX_SEQUENCE];
+	char *s = legal;
+	size_t s_len = legal_length;
+	char *d = actual;
+	size_t d_len = sizeof(actual);
+	if(
+		iconv(handle, &s, &s_len, &d, &d_len) == (size_t)-1
+		|| iconv(handle, NULL, NULL, &d, &d_len) == (size_t)-1
+		|| (size_t)(d - actual) != expected_length
+		|| memcmp(actual, expected, expected_length) != 0)
+	{
+		goto not_table;
+	}
+	iconv_close(handle);
+	return table;
+not_table:
+	free(table);
+	iconv_close(handle);
+	return NULL;
+}
+
+/* It may call iconv_open, so it should be used without the runtime lock.
+   The pairs converted natively do not need the table, and the suffixes like
+   "//TRANSLIT" are left to iconv. */
+static struct table_s *get_table(char const *tocode, char const *fromcode)
+{
+	struct table_s *table = NULL;
+#if defined(SUPPORT_TABLE)
+	if(
+		get_native(tocode, fromcode) == NATIVE_NONE
+		&& strchr(tocode, '/') == NULL && strchr(fromcode, '/') == NULL
+		&& !lookup_cached_table(tocode, fromcode, &table))
+	{
+		table = make_table(tocode, fromcode);
+		cache_table(tocode, fromcode, table);
+	}
+#endif
+	return table;
+}
+
+/* Same as iconv(3). */
+static size_t table_iconv(
+	struct table_s const *table, char **inbuf, size_t *inbytesleft,
+	char **outbuf, size_t *outbytesleft)
+{
+	unsigned char const *s = (unsigned char *)*inbuf;
+	size_t s_len = *inbytesleft;
+	unsigned char *d = (unsigned char *)*outbuf;
+	size_t d_len = *outbytesleft;
+	size_t result = 0;
+	while(s_len > 0){
+		if(table->single){
+			size_t n = (s_len < d_len) ? s_len : d_len;
+			size_t i = 0;
+			while(i < n && table->length[s[i]] != 0){
+				d[i] = table->sequence[s[i]][0];
+				++ i;
+			}
+			s += i;
+			s_len -= i;
+			d += i;
+			d_len -= i;
+		}else{
+			/* Write MAX_TABLE_SEQUENCE bytes at once while there is the space. */
+			while(s_len > 0 && d_len >= MAX_TABLE_SEQUENCE){
+				unsigned char c = *s;
+				size_t length = table->length[c];
+				if(length == 0){
+					break;
+				}
+				memcpy(d, table->sequence[c], MAX_TABLE_SEQUENCE);
+				++ s;
+				-- s_len;
+				d += length;
+				d_len -= length;
+			}
+		}
+		if(s_len == 0){
+			break;
+		}
+		unsigned char c = *s;
+		size_t length = table->length[c];
+		if(length == 0){
+			errno = (d_len < table->space[c]) ? E2BIG : EILSEQ;
+			result = (size_t)-1;
+			break;
+		}else if(d_len < length){
+			errno = E2BIG;
+			result = (size_t)-1;
+			break;
+		}
+		memcpy(d, table->sequence[c], length);
+		++ s;
+		-- s_len;
+		d += length;
+		d_len -= length;
+	}
+	*inbuf = (char *)s;
+	*inbytesleft = s_len;
+	*outbuf = (char *)d;
+	*outbytesleft = d_len;
+	return result;
+}
+
+/* conversion */
+
+/* Inputs longer than this are converted without the runtime lock. */
+static size_t blocking_section_threshold = 0x10000;
+
+/* A copy of struct mliconv_t that can be used without the runtime lock. */
+struct conversion_s {
+	struct handle_owner_s owner; /* released by store_conversion */
+	iconv_t handle;
+	char *tocode;
+	char *fromcode;
+	char substitute[MAX_SEQUENCE];
+	int_least8_t substitute_length;
+	int_least8_t min_sequence_in_fromcode;
+	int_least8_t native;
+	struct table_s const *table;
+	struct report_s *report; /* NULL unless it is requested */
+#if defined(SUPPORT_STATISTICS)
+	struct stats_s stats; /* added to mliconv_t by store_conversion */
+	uint64_t blocking_start;
+#endif
+};
+
+/* The handle is owned until store_conversion, so it should be called before
+   raising.  It returns false if the handle is closed or not opened yet.
+   val_conv should be registered as a local root. */
+static bool try_load_conversion(
+	struct conversion_s *conv, value const *val_conv)
+{
+	if(!try_own_handle(&conv->owner, val_conv)){
+		return false;
+	}
+	struct mliconv_t *internal = mliconv_val(*val_conv);
+	conv->handle = internal->handle;
+	conv->tocode = internal->tocode;
+	conv->fromcode = internal->fromcode;
+	conv->substitute_length = internal->substitute_length;
+	if(conv->substitute_length > 0){
+		memcpy(conv->substitute, internal->substitute, conv->substitute_length);
+	}
+	conv->min_sequence_in_fromcode = internal->min_sequence_in_fromcode;
+	conv->native = internal->native;
+	conv->table = internal->table;
+	conv->report = NULL;
+#if defined(SUPPORT_STATISTICS)
+	memset(&conv->stats, 0, sizeof(conv->stats));
+#endif
+	return true;
+}
+
+static void load_conversion(struct conversion_s *conv, value const *val_conv)
+{
+	while(!try_load_conversion(conv, val_conv)){
+		/* raises if it is closed, or opens the deferred handle */
+		check_handle(val_conv);
+	}
+}
+
+/* The handle is kept owned, so signal handlers are not run here. */
+static void enter_blocking_section(
+	__attribute__((unused)) struct conversion_s *conv)
+{
+#if defined(SUPPORT_STATISTICS)
+	conv->blocking_start = get_time_ns();
+#endif
+	enter_blocking_section_no_signal();
+}
+
+static void leave_blocking_section(
+	__attribute__((unused)) struct conversion_s *conv)
+{
+	caml_leave_blocking_section();
+	COUNT_STAT(
+		&conv->stats, STAT_BLOCKING_NS, get_time_ns() - conv->blocking_start);
+}
+
+static size_t convert_iconv(
+	struct conversion_s *conv, char **inbuf, size_t *inbytesleft,
+	char **outbuf, size_t *outbytesleft)
+{
+#if defined(SUPPORT_STATISTICS)
+	size_t in_before = *inbytesleft;
+	size_t out_before = *outbytesleft;
+#endif
+	/* The native and table conversions are stateless, so the shift state of
+	   the handle is always initial. */
+	size_t result;
+	if(conv->native != NATIVE_NONE){
+		result = native_iconv(conv->native, inbuf, inbytesleft, outbuf, outbytesleft);
+	}else if(conv->table != NULL){
+		result = table_iconv(conv->table, inbuf, inbytesleft, outbuf, outbytesleft);
+	}else{
+		result = iconv(conv->handle, inbuf, inbytesleft, outbuf, outbytesleft);
+	}
+	COUNT_STAT(&conv->stats, STAT_ICONV_CALLS, 1);
+	COUNT_STAT(&conv->stats, STAT_BYTES_IN, in_before - *inbytesleft);
+	COUNT_STAT(&conv->stats, STAT_BYTES_OUT, out_before - *outbytesleft);
+	return result;
+}
+
+/* Write back the lazily probed values and the statistics, and release the
+   handle. */
+static void store_conversion(
+	struct mliconv_t *internal, struct conversion_s *conv)
+{
+	if(internal->substitute_length < 0 && conv->substitute_length >= 0){
+		internal->substitute_length = conv->substitute_length;
+		memcpy(internal->substitute, conv->substitute, conv->substitute_length);
+	}
+	if(internal->min_sequence_in_fromcode < 0){
+		internal->min_sequence_in_fromcode = conv->min_sequence_in_fromcode;
+	}
+#if defined(SUPPORT_STATISTICS)
+	add_stats(&internal->stats, &conv->stats);
+	add_global_stats(&conv->stats);
+#endif
+	disown_handle(&conv->owner);
+}
+
+/* It calls iconv_open, so it should be used without the runtime lock. */
+static void probe_conversion(struct conversion_s *conv)
+{
+	uint64_t probes = 0;
+	if(conv->substitute_length < 0){
+		get_substitute(
+			conv->tocode, conv->substitute, &conv->substitute_length, &probes);
+	}
+	if(conv->min_sequence_in_fromcode < 0){
+		conv->min_sequence_in_fromcode =
+			get_min_sequence_in_fromcode(conv->fromcode, &probes);
+	}
+	COUNT_STAT(&conv->stats, STAT_PROBES, probes);
+}
+
+/* Count the probes out of conversions, for the converter and the process. */
+static void count_probes(
+	__attribute__((unused)) struct mliconv_t *internal,
+	__attribute__((unused)) uint64_t probes)
+{
+#if defined(SUPPORT_STATISTICS)
+	if(probes > 0){
+		struct stats_s stats = {.counters = {[STAT_PROBES] = probes}};
+		add_stats(&internal->stats, &stats);
+		add_global_stats(&stats);
+	}
+#endif
+}
+
+enum {
+	CONVERT_OK,
+	CONVERT_OVERFLOW,
+	CONVERT_ILLEGAL_SEQUENCE,
+	CONVERT_PROBE, /* probe_conversion is needed to continue */
+	CONVERT_OUT_OF_MEMORY,
+	CONVERT_IO_ERROR, /* errno is kept in struct stream_s */
+	CONVERT_FAILED
+};
+
+static int convert(
+	struct conversion_s *conv, bool substitute, bool finish, bool probe,
+	struct iconv_field_s *in, struct iconv_field_s *out)
+{
+	int result = CONVERT_OK;
+	while(in->bytesleft > 0){
+		if(
+			convert_iconv(conv, &in->buf, &in->bytesleft, &out->buf, &out->bytesleft)
+			== (size_t)-1)
+		{
+			int e = errno;
+			if(e == E2BIG){
+				COUNT_STAT(&conv->stats, STAT_OVERFLOWS, 1);
+				result = CONVERT_OVERFLOW;
+				break;
+			}else if(e == EINVAL && !finish){ /* truncated */
+				COUNT_STAT(&conv->stats, STAT_TRUNCATIONS, 1);
+				break;
+			}else if((e == EILSEQ || e == EINVAL) && !substitute){
+				result = CONVERT_ILLEGAL_SEQUENCE;
+				break;
+			}else if(e == EILSEQ || e == EINVAL){
+				if(conv->substitute_length < 0 || conv->min_sequence_in_fromcode < 0){
+					if(!probe){
+						result = CONVERT_PROBE;
+						break;
+					}
+					probe_conversion(conv);
+				}
+				if(
+					put_substitute(
+						conv->handle, conv->substitute, conv->substitute_length, &out->buf,
+						&out->bytesleft)
+					< 0)
+				{
+					if(errno == E2BIG){
+						COUNT_STAT(&conv->stats, STAT_OVERFLOWS, 1);
+						result = CONVERT_OVERFLOW;
+					}else{
+						result = CONVERT_FAILED;
+					}
+					break;
+				}
+				COUNT_STAT(&conv->stats, STAT_SUBSTITUTIONS, 1);
+				if(conv->report != NULL){
+					record_substitution(
+						conv->report, in->buf, out->buf - conv->substitute_length);
+				}
+				skip_min_sequence(
+					conv->min_sequence_in_fromcode, &in->buf, &in->bytesleft);
+			}else{
+				result = CONVERT_FAILED;
+				break;
+			}
+		}
+	}
+	return result;
+}
+
+static int convert_end(struct conversion_s *conv, struct iconv_field_s *out)
+{
+	int result = CONVERT_OK;
+	if(iconv(conv->handle, NULL, NULL, &out->buf, &out->bytesleft) == (size_t)-1){
+		if(errno == E2BIG){
+			COUNT_STAT(&conv->stats, STAT_OVERFLOWS, 1);
+			result = CONVERT_OVERFLOW;
+		}else{
+			result = CONVERT_FAILED;
+		}
+	}
+	return result;
+}
+
+/* Convert all of the input with substitution and the end of shift state,
+   enlarging the scratch buffer. */
+static int convert_to_scratch(
+	struct conversion_s *conv, bool probe, size_t in_length,
+	struct iconv_field_s *in, struct scratch_s *scratch, struct iconv_field_s *out)
+{
+	int result;
+	for(;;){
+		result = convert(conv, true, true, probe, in, out);
+		if(result == CONVERT_OK){
+			result = convert_end(conv, out);
+		}
+		if(result != CONVERT_OVERFLOW){
+			break;
+		}
+		if(!grow_scratch(scratch, in_length - in->bytesleft, in->bytesleft, out)){
+			result = CONVERT_OUT_OF_MEMORY;
+			break;
+		}
+		if(conv->report != NULL){
+			conv->report->out_base = scratch->buf;
+		}
+	}
+	return result;
+}
+
+/* Convert the items one after another into the scratch buffer, recording the
+   end of each output.  The shift state is reset by convert_end between items.
+   If it returns CONVERT_PROBE, the item at *index should be converted again
+   from the end of the previous output. */
+static int convert_items_to_scratch(
+	struct conversion_s *conv, bool probe, size_t count, char * const *items,
+	size_t const *lengths, size_t *index, size_t *consumed,
+	struct scratch_s *scratch, struct iconv_field_s *out, size_t *ends)
+{
+	int result = CONVERT_OK;
+	while(*index < count){
+		size_t i = *index;
+		struct iconv_field_s in = {.buf = items[i], .bytesleft = lengths[i]};
+		result =
+			convert_to_scratch(conv, probe, *consumed + lengths[i], &in, scratch, out);
+		if(result != CONVERT_OK){
+			break;
+		}
+		*consumed += lengths[i];
+		ends[i] = out->buf - scratch->buf;
+		++ *index;
+	}
+	return result;
+}
+
+/* Convert into a small buffer on the stack, and count the length of the
+   output instead of keeping it.  If substitute, the shift state is returned
+   to the initial state at the end. */
+#define MEASURE_BUFFER_SIZE 256
+
+static int convert_to_measure(
+	struct conversion_s *conv, bool substitute, bool probe,
+	struct iconv_field_s *in, size_t *length)
+{
+	int result;
+	for(;;){
+		char buf[MEASURE_BUFFER_SIZE];
+		struct iconv_field_s out = {.buf = buf, .bytesleft = sizeof(buf)};
+		result = convert(conv, substitute, substitute, probe, in, &out);
+		*length += out.buf - buf;
+		if(result != CONVERT_OVERFLOW){
+			break;
+		}
+	}
+	if(result == CONVERT_OK && substitute){
+		char buf[MAX_SEQUENCE * 2];
+		struct iconv_field_s out = {.buf = buf, .bytesleft = sizeof(buf)};
+		result = convert_end(conv, &out);
+		*length += out.buf - buf;
+	}
+	return result;
+}
+
+/* Read from in_fd and write into out_fd by blocks, carrying an incomplete
+   sequence at the end of a block over to the next block.
+   The memory is the two blocks regardless of the length of the input.
+   It should be used without the runtime lock. */
+#define STREAM_BLOCK_SIZE 0x40000
+
+struct stream_s {
+	int in_fd;
+	int out_fd;
+	char *in_buf; /* STREAM_BLOCK_SIZE */
+	size_t in_length; /* the bytes left in in_buf */
+	char *out_buf; /* STREAM_BLOCK_SIZE */
+	uint64_t read_bytes;
+	uint64_t written_bytes;
+	int error;
+	bool write_error; /* error is of out_fd, otherwise of in_fd */
+};
+
+static bool read_stream(struct stream_s *stream, bool *eof)
+{
+	for(;;){
+		ssize_t n = read(
+			stream->in_fd, stream->in_buf + stream->in_length,
+			STREAM_BLOCK_SIZE - stream->in_length);
+		if(n >= 0){
+			*eof = n == 0;
+			stream->in_length += n;
+			stream->read_bytes += n;
+			return true;
+		}else if(errno != EINTR){
+			stream->error = errno;
+			stream->write_error = false;
+			return false;
+		}
+	}
+}
+
+static bool write_stream(struct stream_s *stream, struct iconv_field_s *out)
+{
+	char *p = stream->out_buf;
+	while(p < out->buf){
+		ssize_t n = write(stream->out_fd, p, out->buf - p);
+		if(n >= 0){
+			p += n;
+			stream->written_bytes += n;
+		}else if(errno != EINTR){
+			stream->error = errno;
+			stream->write_error = true;
+			return false;
+		}
+	}
+	out->buf = stream->out_buf;
+	out->bytesleft = STREAM_BLOCK_SIZE;
+	return true;
+}
+
+static int convert_stream(struct conversion_s *conv, struct stream_s *stream)
+{
+	int result;
+	struct iconv_field_s out =
+		{.buf = stream->out_buf, .bytesleft = STREAM_BLOCK_SIZE};
+	bool eof = false;
+	do{
+		if(!read_stream(stream, &eof)){
+			result = CONVERT_IO_ERROR;
+			break;
+		}
+		struct iconv_field_s in =
+			{.buf = stream->in_buf, .bytesleft = stream->in_length};
+		for(;;){
+			/* An incomplete sequence at the end of the input is substituted. */
+			result = convert(conv, true, eof, true, &in, &out);
+			if(result == CONVERT_OK && eof){
+				result = convert_end(conv, &out);
+			}
+			if(result != CONVERT_OVERFLOW){
+				break;
+			}
+			if(!write_stream(stream, &out)){
+				result = CONVERT_IO_ERROR;
+				break;
+			}
+		}
+		memmove(stream->in_buf, in.buf, in.bytesleft);
+		stream->in_length = in.bytesleft;
+	}while(result == CONVERT_OK && !eof);
+	if(result == CONVERT_OK && !write_stream(stream, &out)){
+		result = CONVERT_IO_ERROR;
+	}
+	if(result != CONVERT_OK){
+		iconv(conv->handle, NULL, NULL, NULL, NULL);
+	}
+	return result;
+}
+
+static bool init_stream(struct stream_s *stream)
+{
+	stream->in_buf = caml_stat_alloc_noexc(STREAM_BLOCK_SIZE * 2);
+	stream->in_length = 0;
+	stream->out_buf = stream->in_buf + STREAM_BLOCK_SIZE;
+	stream->read_bytes = 0;
+	stream->written_bytes = 0;
+	stream->error = 0;
+	stream->write_error = false;
+	return stream->in_buf != NULL;
+}
+
+static void done_stream(struct stream_s *stream)
+{
+	caml_stat_free(stream->in_buf);
+}
+
+/* Convert iconv_fields, that is a copy outside of OCaml heap without the
+   runtime lock if it is long. */
+static int convert_fields(
+	value val_conv, value val_fields, bool substitute, bool finish,
+	value val_report)
+{
+	CAMLparam3(val_conv, val_fields, val_report);
+	struct conversion_s conv;
+	load_conversion(&conv, &val_conv);
+	struct report_s report_body;
+	if(!init_report(&conv.report, &report_body, val_report)){
+		store_conversion(mliconv_val(val_conv), &conv);
+		caml_raise_out_of_memory();
+	}
+	struct iconv_field_s in, out;
+	set_fields(&in, val_fields, 0);
+	set_fields(&out, val_fields, 3);
+	int result;
+	if(in.bytesleft < blocking_section_threshold){
+		for(;;){
+			if(conv.report != NULL){
+				conv.report->in_base = String_val(Field(val_fields, 0));
+				conv.report->out_base = (char *)Bytes_val(Field(val_fields, 3));
+			}
+			result = convert(&conv, substitute, finish, false, &in, &out);
+			if(result != CONVERT_PROBE){
+				break;
+			}
+			ptrdiff_t inbuf_offset = get_buf_offset(val_fields, 0, &in);
+			ptrdiff_t outbuf_offset = get_buf_offset(val_fields, 3, &out);
+			enter_blocking_section(&conv);
+			probe_conversion(&conv);
+			leave_blocking_section(&conv);
+			/* The pointer to OCaml heap cannot be kept across blocking sections. */
+			set_buf(&in, val_fields, 0, inbuf_offset);
+			set_buf(&out, val_fields, 3, outbuf_offset);
+		}
+	}else{
+		size_t in_length = in.bytesleft;
+		size_t out_length = out.bytesleft;
+		char *copy = caml_stat_alloc_noexc(in_length + out_length);
+		if(copy == NULL){
+			store_conversion(mliconv_val(val_conv), &conv);
+			done_report(conv.report);
+			caml_raise_out_of_memory();
+		}
+		memcpy(copy, in.buf, in_length);
+		struct iconv_field_s in_copy = {.buf = copy, .bytesleft = in_length};
+		struct iconv_field_s out_copy =
+			{.buf = copy + in_length, .bytesleft = out_length};
+		if(conv.report != NULL){
+			conv.report->in_base = copy;
+			conv.report->in_origin = get_buf_offset(val_fields, 0, &in);
+			conv.report->out_base = copy + in_length;
+			conv.report->out_origin = get_buf_offset(val_fields, 3, &out);
+		}
+		enter_blocking_section(&conv);
+		result = convert(&conv, substitute, finish, true, &in_copy, &out_copy);
+		leave_blocking_section(&conv);
+		/* The pointer to OCaml heap cannot be kept across blocking sections. */
+		set_fields(&in, val_fields, 0);
+		set_fields(&out, val_fields, 3);
+		size_t out_used = out_length - out_copy.bytesleft;
+		memcpy(out.buf, copy + in_length, out_used);
+		in.buf += in_length - in_copy.bytesleft;
+		in.bytesleft = in_copy.bytesleft;
+		out.buf += out_used;
+		out.bytesleft = out_copy.bytesleft;
+		caml_stat_free(copy);
+	}
+	store_conversion(mliconv_val(val_conv), &conv);
+	store_report(val_report, conv.report);
+	get_fields(val_fields, 0, &in);
+	get_fields(val_fields, 3, &out);
+	CAMLreturnT(int, result);
+}
+
+/* Convert iconv_bigarray_fields, that is not moved by GC, without the runtime
+   lock if it is long. */
+static int convert_bigarray_fields(
+	value val_conv, value val_fields, bool substitute, bool finish,
+	value val_report)
+{
+	CAMLparam3(val_conv, val_fields, val_report);
+	CAMLlocal2(val_inbuf, val_outbuf);
+	/* Keep the bigarrays even if the fields are modified by other threads. */
+	val_inbuf = Field(val_fields, 0);
+	val_outbuf = Field(val_fields, 3);
+	struct conversion_s conv;
+	load_conversion(&conv, &val_conv);
+	struct report_s report_body;
+	if(!init_report(&conv.report, &report_body, val_report)){
+		store_conversion(mliconv_val(val_conv), &conv);
+		caml_raise_out_of_memory();
+	}
+	if(conv.report != NULL){
+		conv.report->in_base = Caml_ba_data_val(val_inbuf);
+		conv.report->out_base = Caml_ba_data_val(val_outbuf);
+	}
+	struct iconv_field_s in, out;
+	set_bigarray_fields(&in, val_fields, 0);
+	set_bigarray_fields(&out, val_fields, 3);
+	bool blocking = in.bytesleft >= blocking_section_threshold;
+	if(blocking){
+		enter_blocking_section(&conv);
+	}
+	int result;
+	for(;;){
+		result = convert(&conv, substitute, finish, blocking, &in, &out);
+		if(result != CONVERT_PROBE){
+			break;
+		}
+		enter_blocking_section(&conv);
+		probe_conversion(&conv);
+		leave_blocking_section(&conv);
+	}
+	if(blocking){
+		leave_blocking_section(&conv);
+	}
+	store_conversion(mliconv_val(val_conv), &conv);
+	store_report(val_report, conv.report);
+	get_bigarray_fields(val_fields, 0, Caml_ba_data_val(val_inbuf), &in);
+	get_bigarray_fields(val_fields, 3, Caml_ba_data_val(val_outbuf), &out);
+	CAMLreturnT(int, result);
+}
+
+/* version functions */
+
+CAMLprim value mliconv_get_version_opt(value val_unit)
+{
+	CAMLparam1(val_unit);
+#if defined(_LIBICONV_VERSION)
+	CAMLlocal2(val_result, val_tuple);
+	int version = _libiconv_version;
+	val_tuple = caml_alloc_tuple(2);
+	Store_field(val_tuple, 0, Val_int(version >> 8)); /* major */
+	Store_field(val_tuple, 1, Val_int(version & 0xFF)); /* minor */
+	val_result = caml_alloc_small(1, Tag_some);
+	Store_field(val_result, 0, val_tuple);
+#else
+	CAMLlocal1(val_result);
+	val_result = Val_none;
+#endif
+	CAMLreturn(val_result);
+}
+
+/* open and setting functions */
+
+/* Open the handle into mliconv_t allocated by alloc_mliconv.
+   val_conv should be registered as a local root. */
+static void open_mliconv(
+	value const *val_conv, value val_tocode, value val_fromcode)
+{
+	CAMLparam2(val_tocode, val_fromcode);
+	struct mliconv_t *internal = mliconv_val(*val_conv);
+	internal->handle = NULL;
+	internal->tocode = NULL;
+	internal->fromcode = NULL;
+	const char *tocode = canonicalize(String_val(val_tocode));
 	size_t to_len = caml_string_length(val_tocode);
-	const char *fromcode = String_val(val_fromcode);
+	const char *fromcode = canonicalize(String_val(val_fromcode));
 	size_t from_len = caml_string_length(val_fromcode);
-#if !defined(__GNU_LIBRARY__) || defined(_LIBICONV_VERSION)
-	tocode = iconv_canonicalize(tocode);
-	fromcode = iconv_canonicalize(fromcode);
+	char *stat_tocode = caml_stat_strdup(tocode);
+	internal->tocode = stat_tocode;
+	char *stat_fromcode = caml_stat_strdup(fromcode);
+	internal->fromcode = stat_fromcode;
+	caml_enter_blocking_section();
+	iconv_t handle = iconv_open(stat_tocode, stat_fromcode);
+	int_least8_t native = NATIVE_NONE;
+	struct table_s *table = NULL;
+	if(handle != (iconv_t)-1){
+		native = get_native(stat_tocode, stat_fromcode);
+		table = get_table(stat_tocode, stat_fromcode);
+	}
+	caml_leave_blocking_section();
+	if(handle == (iconv_t)-1){
+		char message[to_len + from_len + 128];
+		strcat(
+			strcat(
+				strcat(
+					strcat(strcpy(message, __func__), ": failed iconv_open to "), stat_tocode),
+				" from "),
+			stat_fromcode);
+		caml_stat_free(stat_tocode);
+		caml_stat_free(stat_fromcode);
+		caml_failwith(message);
+	}
+	/* The pointer to OCaml heap cannot be kept across blocking sections. */
+	internal = mliconv_val(*val_conv);
+	internal->handle = handle;
+	internal->tocode = stat_tocode;
+	internal->fromcode = stat_fromcode;
+	if(!lookup_cached_substitute(
+		stat_tocode, internal->substitute, &internal->substitute_length))
+	{
+		internal->substitute_length = -1;
+	}
+	internal->substitute_is_set = false;
+	internal->min_sequence_in_fromcode = lookup_cached_min_sequence(stat_fromcode);
+	internal->native = native;
+	internal->unexist = UNEXIST_AFTER_OPEN;
+	internal->table = table;
+#if defined(SUPPORT_STATISTICS)
+	memset(&internal->stats, 0, sizeof(internal->stats));
+#endif
+	CAMLreturn0;
+}
+
+CAMLprim value mliconv_open(value val_tocode, value val_fromcode)
+{
+	CAMLparam2(val_tocode, val_fromcode);
+	CAMLlocal1(val_result);
+	/* Do caml_alloc_custom at first because _noexc-version does not exist. */
+	val_result =
+		alloc_mliconv(caml_string_length(val_tocode), caml_string_length(val_fromcode));
+	open_mliconv(&val_result, val_tocode, val_fromcode);
+	CAMLreturn(val_result);
+}
+
+CAMLprim value mliconv_close(value val_conv)
+{
+	CAMLparam1(val_conv);
+	/* Wait for another thread converting with the handle. */
+	struct handle_owner_s owner;
+	bool owned = try_own_handle(&owner, &val_conv);
+	struct mliconv_t *internal = mliconv_val(val_conv);
+	iconv_t handle = internal->handle;
+	internal->handle = NULL;
+	if(owned){
+		disown_handle(&owner);
+		iconv_close(handle);
+	}
+	CAMLreturn(Val_unit);
+}
+
+CAMLprim value mliconv_substitute(value val_conv)
+{
+	CAMLparam1(val_conv);
+	CAMLlocal1(val_result);
+	struct mliconv_t *internal = mliconv_val(val_conv);
+	int_least8_t substitute_length = internal->substitute_length;
+	if(substitute_length < 0){
+		char *tocode = internal->tocode;
+		char substitute[MAX_SEQUENCE];
+		uint64_t probes = 0;
+		caml_enter_blocking_section();
+		get_substitute(tocode, substitute, &substitute_length, &probes);
+		caml_leave_blocking_section();
+		/* The pointer to OCaml heap cannot be kept across blocking sections. */
+		internal = mliconv_val(val_conv);
+		memcpy(internal->substitute, substitute, substitute_length);
+		internal->substitute_length = substitute_length;
+		count_probes(internal, probes);
+	}
+	val_result = caml_alloc_string(substitute_length);
+	internal = mliconv_val(val_conv); /* across OCaml allocation */
+	memcpy(Bytes_val(val_result), internal->substitute, substitute_length);
+	CAMLreturn(val_result);
+}
+
+CAMLprim value mliconv_set_substitute(value val_conv, value val_substitute)
+{
+	CAMLparam2(val_conv, val_substitute);
+	size_t substitute_length = caml_string_length(val_substitute);
+	if(substitute_length > MAX_SEQUENCE){
+		caml_invalid_argument(__func__); /* too long */
+	}
+	struct mliconv_t *internal = mliconv_val(val_conv);
+	char const *substitute = (char *)String_val(val_substitute);
+	internal->substitute_length = substitute_length;
+	memcpy(internal->substitute, substitute, substitute_length);
+	internal->substitute_is_set = true;
+	CAMLreturn(Val_unit);
+}
+
+CAMLprim value mliconv_unexist(value val_conv)
+{
+	CAMLparam1(val_conv);
+	CAMLlocal1(val_result);
+	struct mliconv_t *internal = mliconv_val(val_conv);
+	val_result = get_unexist(internal) ? Val_illegal_sequence : Val_auto;
+	CAMLreturn(val_result);
+}
+
+CAMLprim value mliconv_set_unexist(value val_conv, value val_x)
+{
+	CAMLparam2(val_conv, val_x);
+	struct handle_owner_s owner;
+	own_handle(&owner, &val_conv);
+	bool set = set_unexist(mliconv_val(val_conv), val_x == Val_illegal_sequence);
+	disown_handle(&owner);
+	if(!set){
+		caml_failwith(__func__);
+	}
+	CAMLreturn(Val_unit);
+}
+
+CAMLprim value mliconv_min_sequence_in_fromcode(value val_conv)
+{
+	CAMLparam1(val_conv);
+	struct mliconv_t *internal = mliconv_val(val_conv);
+	int_least8_t result = internal->min_sequence_in_fromcode;
+	if(result < 0){
+		char *fromcode = internal->fromcode;
+		uint64_t probes = 0;
+		caml_enter_blocking_section();
+		result = get_min_sequence_in_fromcode(fromcode, &probes);
+		caml_leave_blocking_section();
+		/* The pointer to OCaml heap cannot be kept across blocking sections. */
+		internal = mliconv_val(val_conv);
+		internal->min_sequence_in_fromcode = result;
+		count_probes(internal, probes);
+	}
+	CAMLreturn(Val_long((long)result));
+}
+
+CAMLprim value mliconv_blocking_section_threshold(value val_unit)
+{
+	CAMLparam1(val_unit);
+	CAMLreturn(Val_long(blocking_section_threshold));
+}
+
+CAMLprim value mliconv_set_blocking_section_threshold(value val_threshold)
+{
+	CAMLparam1(val_threshold);
+	intnat threshold = Long_val(val_threshold);
+	if(threshold <= 0){
+		caml_invalid_argument(__func__);
+	}
+	blocking_section_threshold = threshold;
+	CAMLreturn(Val_unit);
+}
+
+/* converting functions */
+
+CAMLprim value mliconv_unsafe_iconv(
+	value val_conv, value val_fields, value val_finish)
+{
+	CAMLparam3(val_conv, val_fields, val_finish);
+	CAMLlocal1(val_result);
+	switch(
+		convert_fields(val_conv, val_fields, false, Bool_val(val_finish), Val_none))
+	{
+	case CONVERT_OK:
+		val_result = Val_ok;
+		break;
+	case CONVERT_OVERFLOW:
+		val_result = Val_overflow;
+		break;
+	case CONVERT_ILLEGAL_SEQUENCE:
+		val_result = Val_illegal_sequence;
+		break;
+	default:
+		caml_failwith(__func__);
+	}
+	CAMLreturn(val_result);
+}
+
+CAMLprim value mliconv_unsafe_iconv_substitute(
+	value val_conv, value val_fields, value val_finish, value val_report)
+{
+	CAMLparam4(val_conv, val_fields, val_finish, val_report);
+	CAMLlocal1(val_result);
+	switch(
+		convert_fields(
+			val_conv, val_fields, true, Bool_val(val_finish), val_report))
+	{
+	case CONVERT_OK:
+		val_result = Val_ok;
+		break;
+	case CONVERT_OVERFLOW:
+		val_result = Val_overflow;
+		break;
+	default:
+		caml_failwith(__func__);
+	}
+	CAMLreturn(val_result);
+}
+
+CAMLprim value mliconv_unsafe_iconv_end(value val_conv, value val_fields)
+{
+	CAMLparam2(val_conv, val_fields);
+	CAMLlocal1(val_result);
+	struct conversion_s conv;
+	load_conversion(&conv, &val_conv);
+	struct iconv_field_s out;
+	set_fields(&out, val_fields, 3);
+	int result = convert_end(&conv, &out);
+	store_conversion(mliconv_val(val_conv), &conv);
+	switch(result){
+	case CONVERT_OK:
+		val_result = Val_ok;
+		break;
+	case CONVERT_OVERFLOW:
+		val_result = Val_overflow;
+		break;
+	default:
+		caml_failwith(__func__);
+	}
+	get_fields(val_fields, 3, &out);
+	CAMLreturn(val_result);
+}
+
+CAMLprim value mliconv_iconv_reset(value val_conv)
+{
+	CAMLparam1(val_conv);
+	struct handle_owner_s owner;
+	own_handle(&owner, &val_conv);
+	size_t result = iconv(mliconv_val(val_conv)->handle, NULL, NULL, NULL, NULL);
+	disown_handle(&owner);
+	if(result == (size_t)-1){
+		caml_failwith(__func__);
+	}
+	CAMLreturn(Val_unit);
+}
+
+CAMLprim value mliconv_unsafe_iconv_substring(
+	value val_conv, value val_source, value val_pos, value val_len,
+	value val_report)
+{
+	CAMLparam3(val_conv, val_source, val_report);
+	CAMLlocal1(val_result);
+	struct conversion_s conv;
+	load_conversion(&conv, &val_conv);
+	struct report_s report_body;
+	if(!init_report(&conv.report, &report_body, val_report)){
+		store_conversion(mliconv_val(val_conv), &conv);
+		caml_raise_out_of_memory();
+	}
+	size_t s_len = Long_val(val_len);
+	/* The output is converted into the scratch buffer outside of OCaml heap,
+	   and it is enlarged on demand from the estimated length. */
+	struct scratch_s scratch;
+	if(!init_scratch(&scratch, estimate_length(conv.tocode, conv.fromcode, s_len))){
+		store_conversion(mliconv_val(val_conv), &conv);
+		done_report(conv.report);
+		caml_raise_out_of_memory();
+	}
+	if(conv.report != NULL){
+		conv.report->out_base = scratch.buf;
+	}
+	struct iconv_field_s in;
+	struct iconv_field_s out = {.buf = scratch.buf, .bytesleft = scratch.capacity};
+	int result;
+	if(s_len < blocking_section_threshold){
+		in.buf = (char *)String_val(val_source) + Long_val(val_pos);
+		in.bytesleft = s_len;
+		for(;;){
+			if(conv.report != NULL){
+				conv.report->in_base = String_val(val_source);
+			}
+			result = convert_to_scratch(&conv, false, s_len, &in, &scratch, &out);
+			if(result != CONVERT_PROBE){
+				break;
+			}
+			ptrdiff_t inbuf_offset = in.buf - (char *)String_val(val_source);
+			enter_blocking_section(&conv);
+			probe_conversion(&conv);
+			leave_blocking_section(&conv);
+			/* The pointer to OCaml heap cannot be kept across blocking sections. */
+			in.buf = (char *)String_val(val_source) + inbuf_offset;
+		}
+	}else{
+		char *s_copy = caml_stat_alloc_noexc(s_len);
+		if(s_copy == NULL){
+			store_conversion(mliconv_val(val_conv), &conv);
+			done_scratch(&scratch);
+			done_report(conv.report);
+			caml_raise_out_of_memory();
+		}
+		memcpy(s_copy, String_val(val_source) + Long_val(val_pos), s_len);
+		in.buf = s_copy;
+		in.bytesleft = s_len;
+		if(conv.report != NULL){
+			conv.report->in_base = s_copy;
+			conv.report->in_origin = Long_val(val_pos);
+		}
+		enter_blocking_section(&conv);
+		result = convert_to_scratch(&conv, true, s_len, &in, &scratch, &out);
+		leave_blocking_section(&conv);
+		caml_stat_free(s_copy);
+	}
+	if(result != CONVERT_OK){
+		iconv(conv.handle, NULL, NULL, NULL, NULL);
+	}
+	store_conversion(mliconv_val(val_conv), &conv);
+	if(result != CONVERT_OK){
+		done_scratch(&scratch);
+		done_report(conv.report);
+		if(result == CONVERT_OUT_OF_MEMORY){
+			caml_raise_out_of_memory();
+		}else{
+			caml_failwith(__func__);
+		}
+	}
+	store_report(val_report, conv.report);
+	size_t result_len = out.buf - scratch.buf;
+	val_result = caml_alloc_initialized_string(result_len, scratch.buf);
+	done_scratch(&scratch);
+	CAMLreturn(val_result);
+}
+
+CAMLprim value mliconv_iconv_strings(value val_conv, value val_sources)
+{
+	CAMLparam2(val_conv, val_sources);
+	CAMLlocal2(val_result, val_item);
+	size_t count = Wosize_val(val_sources);
+	if(count == 0){
+		CAMLreturn(Atom(0));
+	}
+	struct conversion_s conv;
+	load_conversion(&conv, &val_conv);
+	/* The pointers, the lengths of the sources and the ends of the outputs */
+	char **items = caml_stat_alloc_noexc(
+		count * (sizeof(char *) + sizeof(size_t) * 2));
+	if(items == NULL){
+		store_conversion(mliconv_val(val_conv), &conv);
+		caml_raise_out_of_memory();
+	}
+	size_t *lengths = (size_t *)(items + count);
+	size_t *ends = lengths + count;
+	size_t total = 0;
+	for(size_t i = 0; i < count; ++ i){
+		lengths[i] = caml_string_length(Field(val_sources, i));
+		total += lengths[i];
+	}
+	/* All outputs are converted into one scratch buffer. */
+	struct scratch_s scratch;
+	if(!init_scratch(&scratch, estimate_length(conv.tocode, conv.fromcode, total))){
+		store_conversion(mliconv_val(val_conv), &conv);
+		caml_stat_free(items);
+		caml_raise_out_of_memory();
+	}
+	struct iconv_field_s out = {.buf = scratch.buf, .bytesleft = scratch.capacity};
+	size_t index = 0;
+	size_t consumed = 0;
+	int result;
+	if(total < blocking_section_threshold){
+		for(;;){
+			for(size_t i = index; i < count; ++ i){
+				items[i] = (char *)String_val(Field(val_sources, i));
+			}
+			result = convert_items_to_scratch(
+				&conv, false, count, items, lengths, &index, &consumed, &scratch, &out,
+				ends);
+			if(result != CONVERT_PROBE){
+				break;
+			}
+			iconv(conv.handle, NULL, NULL, NULL, NULL);
+			size_t used = (index > 0) ? ends[index - 1] : 0;
+			out.buf = scratch.buf + used;
+			out.bytesleft = scratch.capacity - used;
+			enter_blocking_section(&conv);
+			probe_conversion(&conv);
+			leave_blocking_section(&conv);
+			/* The pointers to OCaml heap are taken again in the next loop. */
+		}
+	}else{
+		char *s_copy = caml_stat_alloc_noexc(total);
+		if(s_copy == NULL){
+			store_conversion(mliconv_val(val_conv), &conv);
+			done_scratch(&scratch);
+			caml_stat_free(items);
+			caml_raise_out_of_memory();
+		}
+		char *p = s_copy;
+		for(size_t i = 0; i < count; ++ i){
+			memcpy(p, String_val(Field(val_sources, i)), lengths[i]);
+			items[i] = p;
+			p += lengths[i];
+		}
+		enter_blocking_section(&conv);
+		result = convert_items_to_scratch(
+			&conv, true, count, items, lengths, &index, &consumed, &scratch, &out,
+			ends);
+		leave_blocking_section(&conv);
+		caml_stat_free(s_copy);
+	}
+	if(result != CONVERT_OK){
+		iconv(conv.handle, NULL, NULL, NULL, NULL);
+	}
+	store_conversion(mliconv_val(val_conv), &conv);
+	if(result != CONVERT_OK){
+		done_scratch(&scratch);
+		caml_stat_free(items);
+		if(result == CONVERT_OUT_OF_MEMORY){
+			caml_raise_out_of_memory();
+		}else{
+			caml_failwith(__func__);
+		}
+	}
+	/* The results are allocated after all conversions. */
+	val_result = caml_alloc(count, 0);
+	size_t start = 0;
+	for(size_t i = 0; i < count; ++ i){
+		val_item = caml_alloc_initialized_string(ends[i] - start, scratch.buf + start);
+		Store_field(val_result, i, val_item);
+		start = ends[i];
+	}
+	done_scratch(&scratch);
+	caml_stat_free(items);
+	CAMLreturn(val_result);
+}
+
+/* Measure the substring through convert_to_measure, and return the offset
+   where the conversion stopped. */
+static int measure_substring(
+	value val_conv, value val_source, value val_pos, value val_len,
+	bool substitute, size_t *offset, size_t *length)
+{
+	CAMLparam2(val_conv, val_source);
+	struct conversion_s conv;
+	load_conversion(&conv, &val_conv);
+	size_t s_len = Long_val(val_len);
+	struct iconv_field_s in;
+	int result;
+	*length = 0;
+	if(s_len < blocking_section_threshold){
+		in.buf = (char *)String_val(val_source) + Long_val(val_pos);
+		in.bytesleft = s_len;
+		for(;;){
+			result = convert_to_measure(&conv, substitute, false, &in, length);
+			if(result != CONVERT_PROBE){
+				break;
+			}
+			ptrdiff_t inbuf_offset = in.buf - (char *)String_val(val_source);
+			enter_blocking_section(&conv);
+			probe_conversion(&conv);
+			leave_blocking_section(&conv);
+			/* The pointer to OCaml heap cannot be kept across blocking sections. */
+			in.buf = (char *)String_val(val_source) + inbuf_offset;
+		}
+	}else{
+		char *s_copy = caml_stat_alloc_noexc(s_len);
+		if(s_copy == NULL){
+			store_conversion(mliconv_val(val_conv), &conv);
+			caml_raise_out_of_memory();
+		}
+		memcpy(s_copy, String_val(val_source) + Long_val(val_pos), s_len);
+		in.buf = s_copy;
+		in.bytesleft = s_len;
+		enter_blocking_section(&conv);
+		result = convert_to_measure(&conv, substitute, true, &in, length);
+		leave_blocking_section(&conv);
+		caml_stat_free(s_copy);
+	}
+	iconv(conv.handle, NULL, NULL, NULL, NULL);
+	store_conversion(mliconv_val(val_conv), &conv);
+	*offset = s_len - in.bytesleft;
+	CAMLreturnT(int, result);
+}
+
+CAMLprim value mliconv_unsafe_validate_substring(
+	value val_conv, value val_source, value val_pos, value val_len)
+{
+	CAMLparam2(val_conv, val_source);
+	CAMLlocal2(val_result, val_error);
+	size_t offset, length;
+	switch(
+		measure_substring(
+			val_conv, val_source, val_pos, val_len, false, &offset, &length))
+	{
+	case CONVERT_OK:
+		val_error = (offset < (size_t)Long_val(val_len)) ? Val_truncated : Val_ok;
+		break;
+	case CONVERT_ILLEGAL_SEQUENCE:
+		val_error = Val_illegal_sequence;
+		break;
+	default:
+		caml_failwith(__func__);
+	}
+	val_result = caml_alloc_tuple(2);
+	Field(val_result, 0) = val_error;
+	Field(val_result, 1) = Val_long(Long_val(val_pos) + offset);
+	CAMLreturn(val_result);
+}
+
+CAMLprim value mliconv_unsafe_converted_length_of_substring(
+	value val_conv, value val_source, value val_pos, value val_len)
+{
+	CAMLparam2(val_conv, val_source);
+	size_t offset, length;
+	switch(
+		measure_substring(
+			val_conv, val_source, val_pos, val_len, true, &offset, &length))
+	{
+	case CONVERT_OK:
+		break;
+	default:
+		caml_failwith(__func__);
+	}
+	CAMLreturn(Val_long(length));
+}
+
+CAMLprim value mliconv_unsafe_iconv_bigarray(
+	value val_conv, value val_fields, value val_finish)
+{
+	CAMLparam3(val_conv, val_fields, val_finish);
+	CAMLlocal1(val_result);
+	switch(
+		convert_bigarray_fields(
+			val_conv, val_fields, false, Bool_val(val_finish), Val_none))
+	{
+	case CONVERT_OK:
+		val_result = Val_ok;
+		break;
+	case CONVERT_OVERFLOW:
+		val_result = Val_overflow;
+		break;
+	case CONVERT_ILLEGAL_SEQUENCE:
+		val_result = Val_illegal_sequence;
+		break;
+	default:
+		caml_failwith(__func__);
+	}
+	CAMLreturn(val_result);
+}
+
+CAMLprim value mliconv_unsafe_iconv_bigarray_substitute(
+	value val_conv, value val_fields, value val_finish, value val_report)
+{
+	CAMLparam4(val_conv, val_fields, val_finish, val_report);
+	CAMLlocal1(val_result);
+	switch(
+		convert_bigarray_fields(
+			val_conv, val_fields, true, Bool_val(val_finish), val_report))
+	{
+	case CONVERT_OK:
+		val_result = Val_ok;
+		break;
+	case CONVERT_OVERFLOW:
+		val_result = Val_overflow;
+		break;
+	default:
+		caml_failwith(__func__);
+	}
+	CAMLreturn(val_result);
+}
+
+CAMLprim value mliconv_unsafe_iconv_bigarray_end(
+	value val_conv, value val_fields)
+{
+	CAMLparam2(val_conv, val_fields);
+	CAMLlocal1(val_result);
+	struct conversion_s conv;
+	load_conversion(&conv, &val_conv);
+	struct iconv_field_s out;
+	set_bigarray_fields(&out, val_fields, 3);
+	int result = convert_end(&conv, &out);
+	store_conversion(mliconv_val(val_conv), &conv);
+	switch(result){
+	case CONVERT_OK:
+		val_result = Val_ok;
+		break;
+	case CONVERT_OVERFLOW:
+		val_result = Val_overflow;
+		break;
+	default:
+		caml_failwith(__func__);
+	}
+	get_bigarray_fields(val_fields, 3, get_bigarray_data(val_fields, 3), &out);
+	CAMLreturn(val_result);
+}
+
+/* decoding functions */
+
+CAMLprim value mliconv_unsafe_decode_substring(
+	value val_conv, value val_source, value val_pos, value val_len)
+{
+	CAMLparam2(val_conv, val_source);
+	CAMLlocal4(val_result, val_chars, val_offsets, val_error);
+	struct conversion_s conv;
+	load_conversion(&conv, &val_conv);
+	size_t s_len = Long_val(val_len);
+	char *s = (char *)String_val(val_source);
+	char *s_current = s + Long_val(val_pos);
+	/* The output is UTF-32BE, and the number of code points is the length of
+	   the input at most except a sequence that is converted to multiple code
+	   points. */
+	struct scratch_s chars, offsets;
+	size_t capacity = s_len + 1;
+	if(!init_scratch(&chars, capacity * sizeof(uint32_t))){
+		store_conversion(mliconv_val(val_conv), &conv);
+		caml_raise_out_of_memory();
+	}
+	if(!init_scratch(&offsets, capacity * sizeof(size_t))){
+		store_conversion(mliconv_val(val_conv), &conv);
+		done_scratch(&chars);
+		caml_raise_out_of_memory();
+	}
+	size_t length = 0;
+	val_error = Val_ok;
+	while(s_len > 0){
+		char outbuf[MAX_SEQUENCE * 4];
+		char *d = outbuf;
+		size_t d_len = 4; /* one code point */
+		size_t offset = s_current - s;
+		if(convert_iconv(&conv, &s_current, &s_len, &d, &d_len)
+			== (size_t)-1)
+		{
+			int e = errno;
+			if(e == E2BIG && d == outbuf){
+				/* a sequence is converted to multiple code points */
+				d_len = sizeof(outbuf);
+				if(convert_iconv(&conv, &s_current, &s_len, &d, &d_len)
+					== (size_t)-1)
+				{
+					e = errno;
+				}else{
+					e = 0;
+				}
+			}
+			if(e == EILSEQ){
+				val_error = Val_illegal_sequence;
+			}else if(e == EINVAL){
+				val_error = Val_truncated;
+			}else if((e == E2BIG && d == outbuf) || (e != E2BIG && e != 0)){
+				store_conversion(mliconv_val(val_conv), &conv);
+				done_scratch(&chars);
+				done_scratch(&offsets);
+				caml_failwith(__func__);
+			}
+		}
+		size_t produced = (d - outbuf) / 4;
+		if(length + produced >= capacity){
+			capacity += capacity / 2 + produced;
+			if(
+				!grow_scratch_to(&chars, capacity * sizeof(uint32_t))
+				|| !grow_scratch_to(&offsets, capacity * sizeof(size_t)))
+			{
+				store_conversion(mliconv_val(val_conv), &conv);
+				done_scratch(&chars);
+				done_scratch(&offsets);
+				caml_raise_out_of_memory();
+			}
+		}
+		for(size_t i = 0; i < produced; ++ i){
+			unsigned char *p = (unsigned char *)outbuf + i * 4;
+			((uint32_t *)chars.buf)[length] =
+				((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8)
+				| p[3];
+			((size_t *)offsets.buf)[length] = offset;
+			++ length;
+		}
+		if(val_error != Val_ok){
+			break;
+		}
+	}
+	size_t end_offset = s_current - s;
+	store_conversion(mliconv_val(val_conv), &conv);
+	val_chars = caml_alloc(length, 0);
+	for(size_t i = 0; i < length; ++ i){
+		Field(val_chars, i) = Val_long(((uint32_t *)chars.buf)[i]);
+	}
+	done_scratch(&chars);
+	val_offsets = caml_alloc(length + 1, 0);
+	for(size_t i = 0; i < length; ++ i){
+		Field(val_offsets, i) = Val_long(((size_t *)offsets.buf)[i]);
+	}
+	Field(val_offsets, length) = Val_long(end_offset);
+	done_scratch(&offsets);
+	val_result = caml_alloc_tuple(3);
+	Store_field(val_result, 0, val_chars);
+	Store_field(val_result, 1, val_offsets);
+	Store_field(val_result, 2, val_error);
+	CAMLreturn(val_result);
+}
+
+/* detection */
+
+/* The fields are same as detection_counts of iconv.ml. */
+enum {
+	DETECT_NON_ASCII,
+	DETECT_ESCAPES, /* designations of ISO-2022-JP */
+	DETECT_ZEROS_EVEN,
+	DETECT_ZEROS_ODD,
+	DETECT_UTF16BE_PLAUSIBLE, /* 2 per unit at most, see plausibility_utf16 */
+	DETECT_UTF16LE_PLAUSIBLE,
+	DETECT_UTF8_VALID, /* multi-byte sequences */
+	DETECT_UTF8_INVALID,
+	DETECT_SJIS_VALID, /* double-byte sequences */
+	DETECT_SJIS_INVALID,
+	DETECT_SJIS_COMMON, /* hiragana, katakana and punctuations */
+	DETECT_SJIS_KANA, /* half-width katakana */
+	DETECT_EUCJP_VALID,
+	DETECT_EUCJP_INVALID,
+	DETECT_EUCJP_COMMON,
+	DETECT_EUCJP_KANA,
+	DETECT_COUNT
+};
+
+/* ESC and NUL are searched by memchr, and the runs of ASCII are skipped by
+   ascii_run in the other scans.
+   An incomplete sequence at the end is not counted, since the input may be
+   a prefix. */
+
+static void detect_controls(
+	unsigned char const *s, size_t s_len, size_t *counts)
+{
+	unsigned char const *end = s + s_len;
+	unsigned char const *p = s;
+	while((p = memchr(p, '\x1b', end - p)) != NULL){
+		++ p;
+		if(end - p >= 2){
+			if(
+				(p[0] == '$' && (p[1] == '@' || p[1] == 'B'))
+				|| (p[0] == '(' && (p[1] == 'B' || p[1] == 'J' || p[1] == 'I'))
+				|| (end - p >= 3 && p[0] == '$' && p[1] == '(' && p[2] == 'D'))
+			{
+				++ counts[DETECT_ESCAPES];
+			}
+		}
+	}
+	p = s;
+	while((p = memchr(p, 0, end - p)) != NULL){
+		++ counts[((p - s) % 2 == 0) ? DETECT_ZEROS_EVEN : DETECT_ZEROS_ODD];
+		++ p;
+	}
+}
+
+/* ASCII, kana and full-width forms are 2, and CJK ideographs are 1 since
+   double-byte sequences of Shift_JIS also fall into them. */
+static inline __attribute__((always_inline)) int plausibility_utf16(
+	uint32_t unit)
+{
+	if(
+		(unit >= 0x20 && unit < 0x7f) || unit == '\t' || unit == '\n'
+		|| unit == '\r' || (unit >= 0x3000 && unit < 0x3100)
+		|| (unit >= 0xff00 && unit < 0xfff0))
+	{
+		return 2;
+	}else if(unit >= 0x4e00 && unit < 0xa000){
+		return 1;
+	}else{
+		return 0;
+	}
+}
+
+static void detect_utf16(unsigned char const *s, size_t s_len, size_t *counts)
+{
+	for(size_t i = 0; i + 1 < s_len; i += 2){
+		counts[DETECT_UTF16BE_PLAUSIBLE] +=
+			plausibility_utf16(get_native_unit_value(NATIVE_UTF16BE, s + i));
+		counts[DETECT_UTF16LE_PLAUSIBLE] +=
+			plausibility_utf16(get_native_unit_value(NATIVE_UTF16LE, s + i));
+	}
+}
+
+static void detect_utf8(unsigned char const *s, size_t s_len, size_t *counts)
+{
+	size_t i = 0;
+	for(;;){
+		i += ascii_run(s + i, s_len - i);
+		if(i >= s_len){
+			break;
+		}
+		uint32_t code;
+		int length = decode_native(NATIVE_UTF8, s + i, s_len - i, &code);
+		if(length == -EINVAL){
+			counts[DETECT_NON_ASCII] += s_len - i;
+			break;
+		}else if(length < 0 || code > 0x10ffff){
+			++ counts[DETECT_UTF8_INVALID];
+			length = 1;
+		}else{
+			++ counts[DETECT_UTF8_VALID];
+		}
+		counts[DETECT_NON_ASCII] += length;
+		i += length;
+	}
+}
+
+static void detect_sjis(unsigned char const *s, size_t s_len, size_t *counts)
+{
+	size_t i = 0;
+	for(;;){
+		i += ascii_run(s + i, s_len - i);
+		if(i >= s_len){
+			break;
+		}
+		unsigned char lead = s[i];
+		if(lead >= 0xa1 && lead <= 0xdf){
+			++ counts[DETECT_SJIS_KANA];
+			++ i;
+		}else if((lead >= 0x81 && lead <= 0x9f) || (lead >= 0xe0 && lead <= 0xfc)){
+			if(i + 1 >= s_len){
+				break;
+			}
+			unsigned char trail = s[i + 1];
+			if((trail >= 0x40 && trail <= 0x7e) || (trail >= 0x80 && trail <= 0xfc)){
+				++ counts[DETECT_SJIS_VALID];
+				if(
+					(lead == 0x81 && trail <= 0x5b)
+					|| (lead == 0x82 && trail >= 0x9f && trail <= 0xf1)
+					|| (lead == 0x83 && trail <= 0x96))
+				{
+					++ counts[DETECT_SJIS_COMMON];
+				}
+				i += 2;
+			}else{
+				++ counts[DETECT_SJIS_INVALID];
+				++ i;
+			}
+		}else{
+			++ counts[DETECT_SJIS_INVALID];
+			++ i;
+		}
+	}
+}
+
+static void detect_eucjp(unsigned char const *s, size_t s_len, size_t *counts)
+{
+	size_t i = 0;
+	for(;;){
+		i += ascii_run(s + i, s_len - i);
+		if(i >= s_len){
+			break;
+		}
+		unsigned char lead = s[i];
+		size_t length = (lead == 0x8f) ? 3 : 2;
+		if((lead < 0xa1 || lead == 0xff) && lead != 0x8e && lead != 0x8f){
+			++ counts[DETECT_EUCJP_INVALID];
+			++ i;
+			continue;
+		}
+		if(i + length > s_len){
+			break;
+		}
+		unsigned char trail = s[i + 1];
+		if(lead == 0x8e){
+			if(trail >= 0xa1 && trail <= 0xdf){
+				++ counts[DETECT_EUCJP_KANA];
+				i += 2;
+			}else{
+				++ counts[DETECT_EUCJP_INVALID];
+				++ i;
+			}
+		}else if(
+			trail >= 0xa1 && trail != 0xff
+			&& (length == 2 || (s[i + 2] >= 0xa1 && s[i + 2] != 0xff)))
+		{
+			++ counts[DETECT_EUCJP_VALID];
+			if(lead == 0xa4 || lead == 0xa5 || (lead == 0xa1 && trail <= 0xbc)){
+				++ counts[DETECT_EUCJP_COMMON];
+			}
+			i += length;
+		}else{
+			++ counts[DETECT_EUCJP_INVALID];
+			++ i;
+		}
+	}
+}
+
+CAMLprim value mliconv_unsafe_detect_substring(
+	value val_source, value val_pos, value val_len)
+{
+	CAMLparam1(val_source);
+	CAMLlocal1(val_result);
+	unsigned char const *s =
+		(unsigned char const *)String_val(val_source) + Long_val(val_pos);
+	size_t s_len = Long_val(val_len);
+	size_t counts[DETECT_COUNT] = {0};
+	detect_controls(s, s_len, counts);
+	detect_utf8(s, s_len, counts);
+	if(counts[DETECT_NON_ASCII] > 0){
+		detect_sjis(s, s_len, counts);
+		detect_eucjp(s, s_len, counts);
+	}
+	if(
+		counts[DETECT_NON_ASCII] > 0 || counts[DETECT_ZEROS_EVEN] > 0
+		|| counts[DETECT_ZEROS_ODD] > 0)
+	{
+		detect_utf16(s, s_len, counts);
+	}
+	val_result = caml_alloc_tuple(DETECT_COUNT);
+	for(size_t i = 0; i < DETECT_COUNT; ++ i){
+		Field(val_result, i) = Val_long(counts[i]);
+	}
+	CAMLreturn(val_result);
+}
+
+/* line functions */
+
+/* Return the offset of the first CR or LF, or end_pos if not found. */
+CAMLprim value mliconv_unsafe_index_line_end(
+	value val_bytes, value val_pos, value val_end_pos)
+{
+	CAMLparam1(val_bytes);
+	unsigned char const *s = Bytes_val(val_bytes);
+	size_t i = Long_val(val_pos);
+	size_t end_pos = Long_val(val_end_pos);
+#if defined(__SSE2__)
+	__m128i const cr = _mm_set1_epi8('\r');
+	__m128i const lf = _mm_set1_epi8('\n');
+	while(i + 16 <= end_pos){
+		__m128i v = _mm_loadu_si128((__m128i const *)(s + i));
+		int mask =
+			_mm_movemask_epi8(
+				_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+		if(mask != 0){
+			CAMLreturn(Val_long(i + __builtin_ctz(mask)));
+		}
+		i += 16;
+	}
 #endif
-	char *stat_tocode = caml_stat_strdup(tocode);
-	internal->tocode = stat_tocode;
-	char *stat_fromcode = caml_stat_strdup(fromcode);
-	internal->fromcode = stat_fromcode;
-	caml_enter_blocking_section();
-	iconv_t handle = iconv_open(stat_tocode, stat_fromcode);
-	caml_leave_blocking_section();
+	while(i < end_pos && s[i] != '\r' && s[i] != '\n'){
+		++ i;
+	}
+	CAMLreturn(Val_long(i));
+}
+
+/* file functions */
+
+/* The files are opened without the newline conversion on Windows. */
+#if defined(O_BINARY)
+#define OPEN_BINARY O_BINARY
+#else
+#define OPEN_BINARY 0
+#endif
+
+static void raise_stream_error(
+	char const *name, int error) __attribute__((noreturn));
+static void raise_stream_error(char const *name, int error)
+{
+	char const *message = strerror(error);
+	char buf[strlen(name) + strlen(message) + 3];
+	strcat(strcat(strcpy(buf, name), ": "), message);
+	caml_raise_sys_error(caml_copy_string(buf));
+}
+
+CAMLprim value mliconv_convert_file(
+	value val_conv, value val_source, value val_destination)
+{
+	CAMLparam3(val_conv, val_source, val_destination);
+	struct conversion_s conv;
+	load_conversion(&conv, &val_conv);
+	struct stream_s stream;
+	if(!init_stream(&stream)){
+		store_conversion(mliconv_val(val_conv), &conv);
+		caml_raise_out_of_memory();
+	}
+	/* The names are copied to be used without the runtime lock. */
+	char *source = caml_stat_strdup_noexc(String_val(val_source));
+	char *destination = caml_stat_strdup_noexc(String_val(val_destination));
+	if(source == NULL || destination == NULL){
+		store_conversion(mliconv_val(val_conv), &conv);
+		caml_stat_free(source);
+		caml_stat_free(destination);
+		done_stream(&stream);
+		caml_raise_out_of_memory();
+	}
+	char const *failed_name = NULL;
+	int result = CONVERT_IO_ERROR;
+	enter_blocking_section(&conv);
+	stream.in_fd = open(source, O_RDONLY | OPEN_BINARY);
+	if(stream.in_fd < 0){
+		stream.error = errno;
+		failed_name = source;
+	}else{
+		stream.out_fd = open(
+			destination, O_WRONLY | O_CREAT | O_TRUNC | OPEN_BINARY, 0666);
+		if(stream.out_fd < 0){
+			stream.error = errno;
+			failed_name = destination;
+		}else{
+			struct stat out_stat;
+			bool regular = fstat(stream.out_fd, &out_stat) == 0
+				&& S_ISREG(out_stat.st_mode);
+			result = convert_stream(&conv, &stream);
+			if(result == CONVERT_IO_ERROR){
+				failed_name = stream.write_error ? destination : source;
+			}
+			if(close(stream.out_fd) < 0 && result == CONVERT_OK){
+				stream.error = errno;
+				result = CONVERT_IO_ERROR;
+				failed_name = destination;
+			}
+			/* Do not leave the partially written destination, but a device such
+			   as /dev/stdout is kept. */
+			if(result != CONVERT_OK && regular){
+				unlink(destination);
+			}
+		}
+		close(stream.in_fd);
+	}
+	leave_blocking_section(&conv);
+	done_stream(&stream);
+	store_conversion(mliconv_val(val_conv), &conv);
+	if(result == CONVERT_IO_ERROR){
+		char name[strlen(failed_name) + 1];
+		strcpy(name, failed_name);
+		caml_stat_free(source);
+		caml_stat_free(destination);
+		raise_stream_error(name, stream.error);
+	}
+	caml_stat_free(source);
+	caml_stat_free(destination);
+	if(result != CONVERT_OK){
+		caml_failwith(__func__);
+	}
+	CAMLreturn(Val_unit);
+}
+
+/* The output channel should be flushed before. */
+CAMLprim value mliconv_convert_channel(
+	value val_conv, value val_in_channel, value val_out_channel)
+{
+	CAMLparam3(val_conv, val_in_channel, val_out_channel);
+	check_handle(&val_conv); /* opens the deferred handle */
+	struct channel *in_channel = Channel(val_in_channel);
+	struct channel *out_channel = Channel(val_out_channel);
+	/* The handle is owned after locking the channels, that may raise. */
+	Lock(in_channel);
+	Lock(out_channel);
+	struct conversion_s conv;
+	if(!try_load_conversion(&conv, &val_conv)){
+		Unlock(out_channel);
+		Unlock(in_channel);
+		check_handle(&val_conv); /* raises since it is closed */
+	}
+	struct stream_s stream;
+	if(!init_stream(&stream)){
+		Unlock(out_channel);
+		Unlock(in_channel);
+		store_conversion(mliconv_val(val_conv), &conv);
+		caml_raise_out_of_memory();
+	}
+	/* The buffered input precedes. */
+	size_t buffered = in_channel->max - in_channel->curr;
+	if(buffered > STREAM_BLOCK_SIZE){
+		buffered = STREAM_BLOCK_SIZE;
+	}
+	memcpy(stream.in_buf, in_channel->curr, buffered);
+	in_channel->curr += buffered;
+	stream.in_length = buffered;
+	stream.in_fd = in_channel->fd;
+	stream.out_fd = out_channel->fd;
+	enter_blocking_section(&conv);
+	int result = convert_stream(&conv, &stream);
+	leave_blocking_section(&conv);
+	in_channel->offset += stream.read_bytes;
+	out_channel->offset += stream.written_bytes;
+	Unlock(out_channel);
+	Unlock(in_channel);
+	done_stream(&stream);
+	store_conversion(mliconv_val(val_conv), &conv);
+	if(result == CONVERT_IO_ERROR){
+		raise_stream_error(__func__, stream.error);
+	}else if(result != CONVERT_OK){
+		caml_failwith(__func__);
+	}
+	CAMLreturn(Val_unit);
+}
+
+/* Convert iconv_fields into the buffer of the channel directly, with
+   substitution, and flush the channel when the buffer is full.
+   An incomplete sequence is left in iconv_fields unless finish. */
+CAMLprim value mliconv_unsafe_iconv_channel(
+	value val_conv, value val_fields, value val_channel, value val_finish)
+{
+	CAMLparam4(val_conv, val_fields, val_channel, val_finish);
+	bool finish = Bool_val(val_finish);
+	check_handle(&val_conv); /* opens the deferred handle */
+	struct channel *channel = Channel(val_channel);
+	/* The handle is owned after locking the channel, that may raise. */
+	Lock(channel);
+	struct conversion_s conv;
+	if(!try_load_conversion(&conv, &val_conv)){
+		Unlock(channel);
+		check_handle(&val_conv); /* raises since it is closed */
+	}
+	struct iconv_field_s in;
+	set_fields(&in, val_fields, 0);
+	for(;;){
+		struct iconv_field_s out =
+			{.buf = channel->curr, .bytesleft = channel->end - channel->curr};
+		int result = convert(&conv, true, finish, false, &in, &out);
+		if(result == CONVERT_OK && finish){
+			result = convert_end(&conv, &out);
+		}
+		channel->curr = out.buf;
+		if(result == CONVERT_OK){
+			break;
+		}
+		ptrdiff_t inbuf_offset = get_buf_offset(val_fields, 0, &in);
+		if(result == CONVERT_PROBE){
+			enter_blocking_section(&conv);
+			probe_conversion(&conv);
+			leave_blocking_section(&conv);
+		}else if(result == CONVERT_OVERFLOW && channel->curr > channel->buff){
+			/* The handle is released while flushing, that may raise. */
+			store_conversion(mliconv_val(val_conv), &conv);
+			caml_flush_partial(channel);
+			if(!try_load_conversion(&conv, &val_conv)){
+				Unlock(channel);
+				check_handle(&val_conv); /* raises since it is closed */
+			}
+		}else{
+			store_conversion(mliconv_val(val_conv), &conv);
+			Unlock(channel);
+			caml_failwith(__func__);
+		}
+		/* The pointer to OCaml heap cannot be kept across blocking sections. */
+		set_buf(&in, val_fields, 0, inbuf_offset);
+	}
+	store_conversion(mliconv_val(val_conv), &conv);
+#if defined(CHANNEL_FLAG_UNBUFFERED)
+	if(channel->flags & CHANNEL_FLAG_UNBUFFERED){
+		caml_flush(channel);
+	}
+#endif
+	Unlock(channel);
+	get_fields(val_fields, 0, &in);
+	CAMLreturn(Val_unit);
+}
+
+/* parallel conversion */
+
+/* A long input of a stateless encoding is split at the boundaries of
+   characters, and the chunks are converted by threads with their own handles.
+   The outputs are concatenated, so tocode should also be stateless. */
+
+#define PARALLEL_MIN_CHUNK 0x10000
+#define PARALLEL_MAX_WORKERS 64
+#define PARALLEL_RESYNC_WINDOW 0x1000
+
+enum {
+	SPLIT_NONE,
+	SPLIT_ANY, /* single-byte */
+	SPLIT_UTF8,
+	SPLIT_UTF16BE,
+	SPLIT_UTF16LE,
+	SPLIT_UTF32,
+	SPLIT_AFTER_LOW_BYTE /* after a byte that can not be a trail byte */
+};
+
+struct split_s {
+	int kind;
+	unsigned char low; /* the bytes less than this are not trail bytes */
+};
+
+static void get_split(struct conversion_s const *conv, struct split_s *split)
+{
+	static struct {
+		char name[16];
+		int kind;
+		unsigned char low;
+	} const table[] = {
+		{"ANSIX3.41968", SPLIT_ANY, 0},
+		{"ASCII", SPLIT_ANY, 0},
+		{"BIG5", SPLIT_AFTER_LOW_BYTE, 0x40},
+		{"BIG5HKSCS", SPLIT_AFTER_LOW_BYTE, 0x40},
+		{"CP932", SPLIT_AFTER_LOW_BYTE, 0x40},
+		{"CP936", SPLIT_AFTER_LOW_BYTE, 0x30},
+		{"CP949", SPLIT_AFTER_LOW_BYTE, 0x41},
+		{"CP950", SPLIT_AFTER_LOW_BYTE, 0x40},
+		{"CSSHIFTJIS", SPLIT_AFTER_LOW_BYTE, 0x40},
+		{"EUCCN", SPLIT_AFTER_LOW_BYTE, 0x80},
+		{"EUCJP", SPLIT_AFTER_LOW_BYTE, 0x80},
+		{"EUCKR", SPLIT_AFTER_LOW_BYTE, 0x80},
+		{"EUCTW", SPLIT_AFTER_LOW_BYTE, 0x80},
+		{"GB18030", SPLIT_AFTER_LOW_BYTE, 0x30},
+		{"GB2312", SPLIT_AFTER_LOW_BYTE, 0x80},
+		{"GBK", SPLIT_AFTER_LOW_BYTE, 0x30},
+		{"ISO88591", SPLIT_ANY, 0},
+		{"LATIN1", SPLIT_ANY, 0},
+		{"MSKANJI", SPLIT_AFTER_LOW_BYTE, 0x40},
+		{"SHIFTJIS", SPLIT_AFTER_LOW_BYTE, 0x40},
+		{"SJIS", SPLIT_AFTER_LOW_BYTE, 0x40},
+		{"UCS2BE", SPLIT_UTF16BE, 0},
+		{"UCS2LE", SPLIT_UTF16LE, 0},
+		{"UCS4BE", SPLIT_UTF32, 0},
+		{"UCS4LE", SPLIT_UTF32, 0},
+		{"UHC", SPLIT_AFTER_LOW_BYTE, 0x41},
+		{"USASCII", SPLIT_ANY, 0},
+		{"UTF16BE", SPLIT_UTF16BE, 0},
+		{"UTF16LE", SPLIT_UTF16LE, 0},
+		{"UTF32BE", SPLIT_UTF32, 0},
+		{"UTF32LE", SPLIT_UTF32, 0},
+		{"UTF8", SPLIT_UTF8, 0},
+		{"WINDOWS31J", SPLIT_AFTER_LOW_BYTE, 0x40}
+	};
+	split->kind = SPLIT_NONE;
+	split->low = 0;
+	if(conv->table != NULL){
+		split->kind = SPLIT_ANY;
+	}else if(strlen(conv->fromcode) < sizeof(table[0].name)){
+		/* "UTF-16" and "UTF-32" are not here because of BOM */
+		char normalized[sizeof(table[0].name)];
+		normalize_code(conv->fromcode, normalized, sizeof(normalized));
+		for(size_t i = 0; i < sizeof(table) / sizeof(table[0]); ++ i){
+			if(strcmp(normalized, table[i].name) == 0){
+				split->kind = table[i].kind;
+				split->low = table[i].low;
+				break;
+			}
+		}
+	}
+}
+
+/* Return the boundary of characters at or before target, or 0 if it is not
+   found. */
+static size_t find_split(
+	struct split_s const *split, unsigned char const *s, size_t target)
+{
+	size_t result = 0;
+	switch(split->kind){
+	case SPLIT_ANY:
+		result = target;
+		break;
+	case SPLIT_UTF8:
+		/* skip back at most 3 continuation bytes */
+		result = target;
+		while(result > 0 && target - result < 3 && (s[result] & 0xc0) == 0x80){
+			-- result;
+		}
+		break;
+	case SPLIT_UTF16BE:
+	case SPLIT_UTF16LE:
+		result = target & ~(size_t)1;
+		if(result >= 2){
+			unsigned char high = s[result + (split->kind == SPLIT_UTF16LE)];
+			if((high & 0xfc) == 0xdc){ /* low surrogate */
+				result -= 2;
+			}
+		}
+		break;
+	case SPLIT_UTF32:
+		result = target & ~(size_t)3;
+		break;
+	case SPLIT_AFTER_LOW_BYTE:
+		for(size_t i = target; i > 0 && target - i < PARALLEL_RESYNC_WINDOW; -- i){
+			if(s[i - 1] < split->low){
+				result = i;
+				break;
+			}
+		}
+		break;
+	}
+	return result;
+}
+
+/* Check that the outputs of tocode can be concatenated, that is, resetting
+   the shift state outputs nothing and no BOM is output.
+   It calls iconv_open, so it should be used without the runtime lock. */
+static bool is_concatenable(char const *tocode)
+{
+	static char const *const samples[] = {
+		"A", "\xc3\xa9", "\xd0\x96", "\xe3\x81\x82", "\xe4\xb8\xad", "\xea\xb0\x80"
+	};
+	iconv_t handle = iconv_open(tocode, "UTF-8");
 	if(handle == (iconv_t)-1){
-		char message[to_len + from_len + 128];
-		strcat(
-			strcat(
-				strcat(
-					strcat(strcpy(message, __func__), ": failed iconv_open to "), stat_tocode),
-				" from "),
-			stat_fromcode);
-		caml_stat_free(stat_tocode);
-		caml_stat_free(stat_fromcode);
-		caml_failwith(message);
+		return false;
 	}
-	/* The pointer to OCaml heap cannot be kept across blocking sections. */
-	internal = mliconv_val(val_result);
-	internal->handle = handle;
-	internal->tocode = stat_tocode;
-	internal->fromcode = stat_fromcode;
-	internal->substitute_length = -1;
-	internal->min_sequence_in_fromcode = -1;
-	CAMLreturn(val_result);
+	bool result = true;
+	for(size_t i = 0; result && i < sizeof(samples) / sizeof(samples[0]); ++ i){
+		char once[MAX_SEQUENCE * 4];
+		char twice[MAX_SEQUENCE * 8];
+		size_t once_length = 0;
+		for(int n = 1; n <= 2; ++ n){
+			char in[8];
+			size_t sample_length = strlen(samples[i]);
+			memcpy(in, samples[i], sample_length);
+			memcpy(in + sample_length, samples[i], sample_length);
+			char *s = in;
+			size_t s_len = sample_length * n;
+			char *d = (n == 1) ? once : twice;
+			size_t d_len = (n == 1) ? sizeof(once) : sizeof(twice);
+			iconv(handle, NULL, NULL, NULL, NULL);
+			if(iconv(handle, &s, &s_len, &d, &d_len) == (size_t)-1){
+				break; /* the character does not exist in tocode */
+			}
+			size_t before_reset = d_len;
+			if(
+				iconv(handle, NULL, NULL, &d, &d_len) == (size_t)-1
+				|| d_len != before_reset)
+			{
+				result = false;
+				break;
+			}
+			if(n == 1){
+				once_length = d - once;
+			}else{
+				size_t twice_length = d - twice;
+				if(
+					twice_length != once_length * 2
+					|| memcmp(twice, once, once_length) != 0
+					|| memcmp(twice + once_length, once, once_length) != 0)
+				{
+					result = false;
+				}
+			}
+		}
+	}
+	iconv_close(handle);
+	return result;
+}
+
+struct parallel_task_s {
+	struct conversion_s conv;
+	bool ilseq;
+	bool own_handle; /* the handle is opened by the task */
+	char *in;
+	size_t in_length;
+	struct scratch_s scratch;
+	size_t out_length;
+	int result;
+	pthread_t thread;
+};
+
+static void *parallel_task(void *arg)
+{
+	struct parallel_task_s *task = arg;
+	task->scratch.buf = NULL;
+	task->out_length = 0;
+	if(task->own_handle){
+		task->conv.handle = iconv_open(task->conv.tocode, task->conv.fromcode);
+		if(task->conv.handle == (iconv_t)-1){
+			task->result = CONVERT_FAILED;
+			return NULL;
+		}
+#if !defined(_LIBICONV_VERSION) && defined(__FreeBSD__) && __FreeBSD__ >= 10
+		int ilseq = task->ilseq;
+		iconvctl(task->conv.handle, ICONV_SET_ILSEQ_INVALID, &ilseq);
+#endif
+	}
+	if(
+		!init_scratch(
+			&task->scratch,
+			estimate_length(task->conv.tocode, task->conv.fromcode, task->in_length)))
+	{
+		task->result = CONVERT_OUT_OF_MEMORY;
+	}else{
+		struct iconv_field_s in = {.buf = task->in, .bytesleft = task->in_length};
+		struct iconv_field_s out =
+			{.buf = task->scratch.buf, .bytesleft = task->scratch.capacity};
+		task->result = convert_to_scratch(
+			&task->conv, true, task->in_length, &in, &task->scratch, &out);
+		task->out_length = out.buf - task->scratch.buf;
+	}
+	if(task->own_handle){
+		iconv_close(task->conv.handle);
+	}else if(task->result != CONVERT_OK){
+		iconv(task->conv.handle, NULL, NULL, NULL, NULL);
+	}
+	return NULL;
+}
+
+/* Split the input into the tasks, and run them.
+   The first task uses the handle of conv.
+   It should be used without the runtime lock. */
+static size_t run_parallel(
+	struct conversion_s *conv, bool ilseq, char *s, size_t s_len,
+	size_t workers, struct parallel_task_s *tasks)
+{
+	probe_conversion(conv);
+	size_t count = 0;
+	size_t start = 0;
+	struct split_s split;
+	get_split(conv, &split);
+	if(split.kind != SPLIT_NONE && !is_concatenable(conv->tocode)){
+		split.kind = SPLIT_NONE;
+	}
+	for(size_t i = 1; i < workers && split.kind != SPLIT_NONE; ++ i){
+		size_t target = s_len / workers * i;
+		size_t end = find_split(&split, (unsigned char *)s, target);
+		if(end > start){
+			tasks[count].in = s + start;
+			tasks[count].in_length = end - start;
+			++ count;
+			start = end;
+		}
+	}
+	tasks[count].in = s + start;
+	tasks[count].in_length = s_len - start;
+	++ count;
+	for(size_t i = 0; i < count; ++ i){
+		tasks[i].conv = *conv;
+#if defined(SUPPORT_STATISTICS)
+		memset(&tasks[i].conv.stats, 0, sizeof(tasks[i].conv.stats));
+#endif
+		tasks[i].ilseq = ilseq;
+		tasks[i].own_handle = i > 0;
+	}
+	size_t started = 1;
+	while(started < count){
+		if(
+			pthread_create(
+				&tasks[started].thread, NULL, parallel_task, &tasks[started])
+			!= 0)
+		{
+			break;
+		}
+		++ started;
+	}
+	for(size_t i = started; i < count; ++ i){
+		parallel_task(&tasks[i]); /* failed to create a thread */
+	}
+	parallel_task(&tasks[0]);
+	for(size_t i = 1; i < started; ++ i){
+		pthread_join(tasks[i].thread, NULL);
+	}
+#if defined(SUPPORT_STATISTICS)
+	for(size_t i = 0; i < count; ++ i){
+		add_stats(&conv->stats, &tasks[i].conv.stats);
+	}
+#endif
+	return count;
+}
+
+/* Check the results, and return the total length of the outputs. */
+static int check_parallel(
+	struct parallel_task_s const *tasks, size_t count, size_t *total)
+{
+	int result = CONVERT_OK;
+	*total = 0;
+	for(size_t i = 0; i < count; ++ i){
+		if(tasks[i].result != CONVERT_OK && result == CONVERT_OK){
+			result = tasks[i].result;
+		}
+		*total += tasks[i].out_length;
+	}
+	return result;
+}
+
+/* Concatenate the outputs into dst if it is not NULL, and free the tasks. */
+static void done_parallel(
+	struct parallel_task_s *tasks, size_t count, char *dst)
+{
+	for(size_t i = 0; i < count; ++ i){
+		if(dst != NULL){
+			memcpy(dst, tasks[i].scratch.buf, tasks[i].out_length);
+			dst += tasks[i].out_length;
+		}
+		if(tasks[i].scratch.buf != NULL){
+			done_scratch(&tasks[i].scratch);
+		}
+	}
+	caml_stat_free(tasks);
+}
+
+/* It returns NULL if out of memory. */
+static struct parallel_task_s *alloc_parallel(size_t *workers)
+{
+	if(*workers < 1){
+		*workers = 1;
+	}else if(*workers > PARALLEL_MAX_WORKERS){
+		*workers = PARALLEL_MAX_WORKERS;
+	}
+	return caml_stat_alloc_noexc(*workers * sizeof(struct parallel_task_s));
+}
+
+/* The number of chunks is limited so that each chunk is long enough. */
+static size_t limit_workers(size_t workers, size_t s_len)
+{
+	size_t max_workers = s_len / PARALLEL_MIN_CHUNK;
+	if(workers > max_workers){
+		workers = (max_workers > 0) ? max_workers : 1;
+	}
+	return workers;
+}
+
+CAMLprim value mliconv_parallel_recommended_workers(value val_unit)
+{
+	CAMLparam1(val_unit);
+	long workers = 1;
+#if defined(_SC_NPROCESSORS_ONLN)
+	workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if(workers < 1){
+		workers = 1;
+	}
+#endif
+	CAMLreturn(Val_long(workers));
 }
 
-CAMLprim value mliconv_substitute(value val_conv)
+CAMLprim value mliconv_parallel_unsafe_convert_substring(
+	value val_conv, value val_source, value val_pos, value val_len,
+	value val_workers)
 {
-	CAMLparam1(val_conv);
+	CAMLparam2(val_conv, val_source);
 	CAMLlocal1(val_result);
-	struct mliconv_t *internal = mliconv_val(val_conv);
-	int_least8_t substitute_length = internal->substitute_length;
-	if(substitute_length < 0){
-		char *tocode = internal->tocode;
-		char substitute[MAX_SEQUENCE];
-		caml_enter_blocking_section();
-		get_substitute(tocode, substitute, &substitute_length);
-		caml_leave_blocking_section();
-		/* The pointer to OCaml heap cannot be kept across blocking sections. */
-		internal = mliconv_val(val_conv);
-		memcpy(internal->substitute, substitute, substitute_length);
-		internal->substitute_length = substitute_length;
+	struct conversion_s conv;
+	load_conversion(&conv, &val_conv);
+	bool ilseq = get_unexist(mliconv_val(val_conv));
+	size_t s_len = Long_val(val_len);
+	size_t workers = limit_workers(Long_val(val_workers), s_len);
+	struct parallel_task_s *tasks = alloc_parallel(&workers);
+	if(tasks == NULL){
+		store_conversion(mliconv_val(val_conv), &conv);
+		caml_raise_out_of_memory();
 	}
-	val_result = caml_alloc_string(substitute_length);
-	internal = mliconv_val(val_conv); /* across OCaml allocation */
-	memcpy(Bytes_val(val_result), internal->substitute, substitute_length);
+	/* The string is copied to be read by the threads. */
+	char *s_copy = caml_stat_alloc_noexc(s_len);
+	if(s_copy == NULL){
+		store_conversion(mliconv_val(val_conv), &conv);
+		caml_stat_free(tasks);
+		caml_raise_out_of_memory();
+	}
+	memcpy(s_copy, String_val(val_source) + Long_val(val_pos), s_len);
+	enter_blocking_section(&conv);
+	size_t count = run_parallel(&conv, ilseq, s_copy, s_len, workers, tasks);
+	leave_blocking_section(&conv);
+	caml_stat_free(s_copy);
+	store_conversion(mliconv_val(val_conv), &conv);
+	size_t total;
+	int result = check_parallel(tasks, count, &total);
+	if(result != CONVERT_OK){
+		done_parallel(tasks, count, NULL);
+		if(result == CONVERT_OUT_OF_MEMORY){
+			caml_raise_out_of_memory();
+		}else{
+			caml_failwith(__func__);
+		}
+	}
+	val_result = caml_alloc_string(total);
+	done_parallel(tasks, count, (char *)Bytes_val(val_result));
 	CAMLreturn(val_result);
 }
 
-CAMLprim value mliconv_set_substitute(value val_conv, value val_substitute)
+CAMLprim value mliconv_parallel_unsafe_convert_bigarray(
+	value val_conv, value val_source, value val_workers)
 {
-	CAMLparam2(val_conv, val_substitute);
-	size_t substitute_length = caml_string_length(val_substitute);
-	if(substitute_length > MAX_SEQUENCE){
-		caml_invalid_argument(__func__); /* too long */
+	CAMLparam2(val_conv, val_source);
+	CAMLlocal1(val_result);
+	struct conversion_s conv;
+	load_conversion(&conv, &val_conv);
+	bool ilseq = get_unexist(mliconv_val(val_conv));
+	size_t s_len = Caml_ba_array_val(val_source)->dim[0];
+	size_t workers = limit_workers(Long_val(val_workers), s_len);
+	struct parallel_task_s *tasks = alloc_parallel(&workers);
+	if(tasks == NULL){
+		store_conversion(mliconv_val(val_conv), &conv);
+		caml_raise_out_of_memory();
 	}
-	struct mliconv_t *internal = mliconv_val(val_conv);
-	char const *substitute = (char *)String_val(val_substitute);
-	internal->substitute_length = substitute_length;
-	memcpy(internal->substitute, substitute, substitute_length);
-	CAMLreturn(Val_unit);
+	/* The bigarray is not moved by GC. */
+	char *s = Caml_ba_data_val(val_source);
+	enter_blocking_section(&conv);
+	size_t count = run_parallel(&conv, ilseq, s, s_len, workers, tasks);
+	leave_blocking_section(&conv);
+	store_conversion(mliconv_val(val_conv), &conv);
+	size_t total;
+	int result = check_parallel(tasks, count, &total);
+	if(result != CONVERT_OK){
+		done_parallel(tasks, count, NULL);
+		if(result == CONVERT_OUT_OF_MEMORY){
+			caml_raise_out_of_memory();
+		}else{
+			caml_failwith(__func__);
+		}
+	}
+	val_result = caml_ba_alloc_dims(CAML_BA_CHAR | CAML_BA_C_LAYOUT, 1, NULL, total);
+	done_parallel(tasks, count, Caml_ba_data_val(val_result));
+	CAMLreturn(val_result);
 }
 
-CAMLprim value mliconv_unexist(value val_conv)
+/* pool */
+
+struct pool_entry_s {
+	iconv_t handle;
+	char *tocode;
+	char *fromcode;
+	char substitute[MAX_SEQUENCE];
+	int_least8_t substitute_length;
+	int_least8_t min_sequence_in_fromcode;
+	int_least8_t native;
+	bool substitute_is_set;
+	bool unexist;
+	struct table_s *table;
+	unsigned long stamp;
+};
+
+struct pool_s {
+	pthread_mutex_t mutex;
+	size_t capacity;
+	size_t length;
+	unsigned long stamp;
+	unsigned long hits;
+	unsigned long misses;
+	struct pool_entry_s entries[];
+};
+
+static inline struct pool_s *pool_val(value v)
 {
-	CAMLparam1(val_conv);
-	CAMLlocal1(val_result);
-	struct mliconv_t *internal = mliconv_val(val_conv);
-	val_result = get_unexist(internal) ? Val_illegal_sequence : Val_auto;
-	CAMLreturn(val_result);
+	return *(struct pool_s **)(Data_custom_val(v));
 }
 
-CAMLprim value mliconv_set_unexist(value val_conv, value val_x)
+static void close_pool_entry(struct pool_entry_s *entry)
 {
-	CAMLparam2(val_conv, val_x);
-	struct mliconv_t *internal = mliconv_val(val_conv);
-	set_unexist(internal, val_x == Val_illegal_sequence);
-	CAMLreturn(Val_unit);
+	iconv_close(entry->handle);
+	caml_stat_free(entry->tocode);
+	caml_stat_free(entry->fromcode);
 }
 
-CAMLprim value mliconv_min_sequence_in_fromcode(value val_conv)
+static void mliconv_pool_finalize(value v)
 {
-	CAMLparam1(val_conv);
-	struct mliconv_t *internal = mliconv_val(val_conv);
-	int_least8_t result = internal->min_sequence_in_fromcode;
-	if(result < 0){
-		char *fromcode = internal->fromcode;
-		caml_enter_blocking_section();
-		result = get_min_sequence_in_fromcode(fromcode);
-		caml_leave_blocking_section();
-		/* The pointer to OCaml heap cannot be kept across blocking sections. */
-		internal = mliconv_val(val_conv);
-		internal->min_sequence_in_fromcode = result;
+	struct pool_s *pool = pool_val(v);
+	if(pool == NULL){
+		return; /* caml_stat_alloc has raised in mliconv_pool_create */
 	}
-	CAMLreturn(Val_long((long)result));
+	for(size_t i = 0; i < pool->length; ++ i){
+		close_pool_entry(&pool->entries[i]);
+	}
+	pthread_mutex_destroy(&pool->mutex);
+	caml_stat_free(pool);
 }
 
-/* converting functions */
+static struct custom_operations pool_ops = {
+	.identifier = "jp.halfmoon.panathenaia.iconv.pool",
+	.finalize = mliconv_pool_finalize,
+	.compare = custom_compare_default,
+	.hash = custom_hash_default,
+	.serialize = custom_serialize_default,
+	.deserialize = custom_deserialize_default};
 
-CAMLprim value mliconv_unsafe_iconv(
-	value val_conv, value val_fields, value val_finish)
+/* The substitute and unexist are a part of the key not to set them again. */
+static bool same_pool_key(
+	struct pool_entry_s const *item, struct pool_entry_s const *key)
 {
-	CAMLparam3(val_conv, val_fields, val_finish);
-	CAMLlocal1(val_result);
-	val_result = Val_ok;
-	struct mliconv_t *internal = mliconv_val(val_conv);
-	struct iconv_field_s in, out;
-	set_fields(&in, val_fields, 0);
-	set_fields(&out, val_fields, 3);
-	while(in.bytesleft > 0){
-		if(iconv(internal->handle, &in.buf, &in.bytesleft, &out.buf, &out.bytesleft)
-			== (size_t)-1)
+	return strcmp(item->tocode, key->tocode) == 0
+		&& strcmp(item->fromcode, key->fromcode) == 0
+		&& item->substitute_is_set == key->substitute_is_set
+		&& (!key->substitute_is_set
+			|| (item->substitute_length == key->substitute_length
+				&& memcmp(item->substitute, key->substitute, key->substitute_length) == 0))
+		&& item->unexist == key->unexist;
+}
+
+/* It should be called with the mutex of the pool.
+   The most recently returned one is taken. */
+static bool take_pool_entry(
+	struct pool_s *pool, struct pool_entry_s const *key,
+	struct pool_entry_s *entry)
+{
+	bool result = false;
+	size_t found = pool->length;
+	for(size_t i = 0; i < pool->length; ++ i){
+		struct pool_entry_s *item = &pool->entries[i];
+		if(same_pool_key(item, key)
+			&& (found == pool->length || item->stamp > pool->entries[found].stamp))
 		{
-			int e = errno;
-			if(e == E2BIG){
-				val_result = Val_overflow;
-				break;
-			}else if(e == EINVAL && !Bool_val(val_finish)){ /* truncated */
-				break;
-			}else if(e == EILSEQ || e == EINVAL){
-				val_result = Val_illegal_sequence;
-				break;
-			}else{
-				caml_failwith(__func__);
-			}
+			found = i;
 		}
 	}
-	get_fields(val_fields, 0, &in);
-	get_fields(val_fields, 3, &out);
-	CAMLreturn(val_result);
+	if(found < pool->length){
+		*entry = pool->entries[found];
+		-- pool->length;
+		pool->entries[found] = pool->entries[pool->length];
+		result = true;
+	}
+	return result;
 }
 
-CAMLprim value mliconv_unsafe_iconv_substitute(
-	value val_conv, value val_fields, value val_finish)
+/* It should be called with the mutex of the pool.
+   The least recently returned one is evicted if it is full. */
+static bool put_pool_entry(
+	struct pool_s *pool, struct pool_entry_s const *entry,
+	struct pool_entry_s *evicted)
 {
-	CAMLparam3(val_conv, val_fields, val_finish);
-	CAMLlocal1(val_result);
-	val_result = Val_ok;
-	struct mliconv_t *internal = mliconv_val(val_conv);
-	struct iconv_field_s in, out;
-	set_fields(&in, val_fields, 0);
-	set_fields(&out, val_fields, 3);
-	while(in.bytesleft > 0){
-		if(iconv(internal->handle, &in.buf, &in.bytesleft, &out.buf, &out.bytesleft)
-			== (size_t)-1)
-		{
-			int e = errno;
-			if(e == E2BIG){
-				val_result = Val_overflow;
-				break;
-			}else if(e == EINVAL && !Bool_val(val_finish)){ /* truncated */
-				break;
-			}else if(e == EILSEQ || e == EINVAL){
-				int_least8_t substitute_length = internal->substitute_length;
-				int_least8_t min_sequence_in_fromcode = internal->min_sequence_in_fromcode;
-				if(substitute_length < 0 || min_sequence_in_fromcode < 0){
-					intptr_t inbuf_offset = get_buf_offset(val_fields, 0, &in);
-					intptr_t outbuf_offset = get_buf_offset(val_fields, 3, &out);
-					char *tocode = internal->tocode;
-					char *fromcode = internal->fromcode;
-					char substitute[MAX_SEQUENCE];
-					caml_enter_blocking_section();
-					if(substitute_length < 0){
-						get_substitute(tocode, substitute, &substitute_length);
-					}
-					if(min_sequence_in_fromcode < 0){
-						min_sequence_in_fromcode = get_min_sequence_in_fromcode(fromcode);
-					}
-					caml_leave_blocking_section();
-					/* The pointer to OCaml heap cannot be kept across blocking sections. */
-					internal = mliconv_val(val_conv);
-					if(internal->substitute_length < 0){
-						internal->substitute_length = substitute_length;
-						memcpy(internal->substitute, substitute, substitute_length);
-					}
-					if(internal->min_sequence_in_fromcode < 0){
-						internal->min_sequence_in_fromcode = min_sequence_in_fromcode;
-					}
-					set_buf(&in, val_fields, 0, inbuf_offset);
-					set_buf(&out, val_fields, 3, outbuf_offset);
-				}
-				if(
-					put_substitute(
-						internal->handle, internal->substitute, substitute_length, &out.buf,
-						&out.bytesleft)
-					< 0)
-				{
-					e = errno;
-					if(e == E2BIG){
-						val_result = Val_overflow;
-						break;
-					}else{
-						caml_failwith(__func__);
-					}
-				}
-				skip_min_sequence(min_sequence_in_fromcode, &in.buf, &in.bytesleft);
-			}else{
-				caml_failwith(__func__);
+	bool result = false;
+	size_t index = pool->length;
+	if(pool->length == pool->capacity){
+		index = 0;
+		for(size_t i = 1; i < pool->length; ++ i){
+			if(pool->entries[i].stamp < pool->entries[index].stamp){
+				index = i;
 			}
 		}
+		*evicted = pool->entries[index];
+		result = true;
+	}else{
+		++ pool->length;
 	}
-	get_fields(val_fields, 0, &in);
-	get_fields(val_fields, 3, &out);
+	pool->entries[index] = *entry;
+	pool->entries[index].stamp = ++ pool->stamp;
+	return result;
+}
+
+CAMLprim value mliconv_pool_create(value val_capacity)
+{
+	CAMLparam1(val_capacity);
+	CAMLlocal1(val_result);
+	intnat capacity = Long_val(val_capacity);
+	if(capacity <= 0){
+		caml_invalid_argument(__func__);
+	}
+	/* Do caml_alloc_custom at first because _noexc-version does not exist.
+	   The pool is NULL until it is initialized. */
+	val_result = caml_alloc_custom(&pool_ops, sizeof(struct pool_s *), 0, 1);
+	*(struct pool_s **)(Data_custom_val(val_result)) = NULL;
+	struct pool_s *pool = caml_stat_alloc(
+		sizeof(struct pool_s) + capacity * sizeof(struct pool_entry_s));
+	pthread_mutex_init(&pool->mutex, NULL);
+	pool->capacity = capacity;
+	pool->length = 0;
+	pool->stamp = 0;
+	pool->hits = 0;
+	pool->misses = 0;
+	*(struct pool_s **)(Data_custom_val(val_result)) = pool;
 	CAMLreturn(val_result);
 }
 
-CAMLprim value mliconv_unsafe_iconv_end(value val_conv, value val_fields)
+CAMLprim value mliconv_pool_checkout(
+	value val_pool, value val_tocode, value val_fromcode,
+	value val_substitute, value val_unexist)
 {
-	CAMLparam2(val_conv, val_fields);
+	CAMLparam5(val_pool, val_tocode, val_fromcode, val_substitute, val_unexist);
 	CAMLlocal1(val_result);
-	val_result = Val_ok;
-	struct mliconv_t *internal = mliconv_val(val_conv);
-	struct iconv_field_s out;
-	set_fields(&out, val_fields, 3);
-	if(iconv(internal->handle, NULL, NULL, &out.buf, &out.bytesleft)
-		== (size_t)-1)
-	{
-		int e = errno;
-		if(e == E2BIG){
-			val_result = Val_overflow;
-		}else{
-			caml_failwith(__func__);
+	struct pool_entry_s key;
+	key.substitute_is_set = Is_block(val_substitute);
+	if(key.substitute_is_set){
+		size_t substitute_length = caml_string_length(Field(val_substitute, 0));
+		if(substitute_length > MAX_SEQUENCE){
+			caml_invalid_argument(__func__); /* too long */
+		}
+		key.substitute_length = substitute_length;
+		memcpy(key.substitute, String_val(Field(val_substitute, 0)), substitute_length);
+	}
+	/* unexist can not be changed other than Citrus. */
+	key.unexist = UNEXIST_AFTER_OPEN;
+#if !defined(_LIBICONV_VERSION) && defined(__FreeBSD__) && __FreeBSD__ >= 10
+	if(Is_block(val_unexist)){
+		key.unexist = Field(val_unexist, 0) == Val_illegal_sequence;
+	}
+#endif
+	/* Do caml_alloc_custom at first not to lose the taken entry.
+	   It is also opened on a miss, not to allocate another one. */
+	val_result =
+		alloc_mliconv(caml_string_length(val_tocode), caml_string_length(val_fromcode));
+	struct mliconv_t *internal = mliconv_val(val_result);
+	internal->handle = NULL;
+	internal->tocode = NULL;
+	internal->fromcode = NULL;
+	struct pool_s *pool = pool_val(val_pool);
+	/* The names are not modified while the runtime lock is held. */
+	key.tocode = (char *)canonicalize(String_val(val_tocode));
+	key.fromcode = (char *)canonicalize(String_val(val_fromcode));
+	struct pool_entry_s entry;
+	pthread_mutex_lock(&pool->mutex);
+	bool hit = take_pool_entry(pool, &key, &entry);
+	if(hit){
+		++ pool->hits;
+	}else{
+		++ pool->misses;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	if(hit){
+		internal->handle = entry.handle;
+		internal->tocode = entry.tocode;
+		internal->fromcode = entry.fromcode;
+		if(entry.substitute_is_set){
+			memcpy(internal->substitute, entry.substitute, entry.substitute_length);
+			internal->substitute_length = entry.substitute_length;
+		}else if(!lookup_cached_substitute(
+			entry.tocode, internal->substitute, &internal->substitute_length))
+		{
+			internal->substitute_length = -1;
+		}
+		internal->substitute_is_set = entry.substitute_is_set;
+		internal->min_sequence_in_fromcode = entry.min_sequence_in_fromcode;
+		internal->native = entry.native;
+		internal->unexist = entry.unexist;
+		internal->table = entry.table;
+#if defined(SUPPORT_STATISTICS)
+		memset(&internal->stats, 0, sizeof(internal->stats));
+#endif
+	}else{
+		open_mliconv(&val_result, val_tocode, val_fromcode);
+		if(Is_block(val_substitute)){
+			mliconv_set_substitute(val_result, Field(val_substitute, 0));
+		}
+		if(Is_block(val_unexist)){
+			mliconv_set_unexist(val_result, Field(val_unexist, 0));
 		}
 	}
-	get_fields(val_fields, 3, &out);
 	CAMLreturn(val_result);
 }
 
-CAMLprim value mliconv_iconv_reset(value val_conv)
+CAMLprim value mliconv_pool_return(value val_pool, value val_conv)
 {
-	CAMLparam1(val_conv);
+	CAMLparam2(val_pool, val_conv);
+	check_handle(&val_conv);
+	struct pool_entry_s entry;
+	entry.tocode = caml_stat_strdup(mliconv_val(val_conv)->tocode);
+	entry.fromcode = caml_stat_strdup_noexc(mliconv_val(val_conv)->fromcode);
+	if(entry.fromcode == NULL){
+		caml_stat_free(entry.tocode);
+		caml_raise_out_of_memory();
+	}
+	/* Wait for another thread converting with the handle, not to give it to
+	   the next user of the pool. */
+	struct handle_owner_s owner;
+	if(!try_own_handle(&owner, &val_conv)){
+		caml_stat_free(entry.tocode);
+		caml_stat_free(entry.fromcode);
+		check_handle(&val_conv); /* raises since it is closed */
+	}
 	struct mliconv_t *internal = mliconv_val(val_conv);
 	if(iconv(internal->handle, NULL, NULL, NULL, NULL) == (size_t)-1){
+		disown_handle(&owner);
+		caml_stat_free(entry.tocode);
+		caml_stat_free(entry.fromcode);
 		caml_failwith(__func__);
 	}
+	entry.handle = internal->handle;
+	memcpy(entry.substitute, internal->substitute, MAX_SEQUENCE);
+	entry.substitute_length = internal->substitute_length;
+	entry.min_sequence_in_fromcode = internal->min_sequence_in_fromcode;
+	entry.native = internal->native;
+	entry.substitute_is_set = internal->substitute_is_set;
+	entry.unexist = internal->unexist;
+	entry.table = internal->table;
+	internal->handle = NULL;
+	disown_handle(&owner);
+	struct pool_s *pool = pool_val(val_pool);
+	struct pool_entry_s evicted;
+	pthread_mutex_lock(&pool->mutex);
+	bool full = put_pool_entry(pool, &entry, &evicted);
+	pthread_mutex_unlock(&pool->mutex);
+	if(full){
+		close_pool_entry(&evicted);
+	}
 	CAMLreturn(Val_unit);
 }
 
-CAMLprim value mliconv_unsafe_iconv_substring(
-	value val_conv, value val_source, value val_pos, value val_len)
+CAMLprim value mliconv_pool_hits(value val_pool)
 {
-	CAMLparam2(val_conv, val_source);
-	CAMLlocal2(val_result, val_d);
-	size_t s_len = Long_val(val_len);
-	size_t d_len = s_len * MAX_SEQUENCE;
-	val_d = caml_alloc_string(d_len);
-	struct mliconv_t *internal = mliconv_val(val_conv);
-	/* const */ char *s = (char *)String_val(val_source);
-	/* const */ char *s_current = s + Long_val(val_pos);
-	char *d = (char *)Bytes_val(val_d);
-	char *d_current = d;
-	bool failed = false;
-	while(s_len > 0){
-		if(iconv(internal->handle, &s_current, &s_len, &d_current, &d_len)
-			== (size_t)-1)
-		{
-			int e = errno;
-			if(e == EILSEQ || e == EINVAL){
-				int_least8_t substitute_length = internal->substitute_length;
-				int_least8_t min_sequence_in_fromcode = internal->min_sequence_in_fromcode;
-				if(substitute_length < 0 || min_sequence_in_fromcode < 0){
-					intptr_t inbuf_offset = s_current - s;
-					intptr_t outbuf_offset = d_current - d;
-					char *tocode = internal->tocode;
-					char *fromcode = internal->fromcode;
-					char substitute[MAX_SEQUENCE];
-					caml_enter_blocking_section();
-					if(substitute_length < 0){
-						get_substitute(tocode, substitute, &substitute_length);
-					}
-					if(min_sequence_in_fromcode < 0){
-						min_sequence_in_fromcode = get_min_sequence_in_fromcode(fromcode);
-					}
-					caml_leave_blocking_section();
-					/* The pointer to OCaml heap cannot be kept across blocking sections. */
-					internal = mliconv_val(val_conv);
-					if(internal->substitute_length < 0){
-						internal->substitute_length = substitute_length;
-						memcpy(internal->substitute, substitute, substitute_length);
-					}
-					if(internal->min_sequence_in_fromcode < 0){
-						internal->min_sequence_in_fromcode = min_sequence_in_fromcode;
-					}
-					s = (char *)String_val(val_source);
-					d = (char *)Bytes_val(val_d);
-					s_current = s + inbuf_offset;
-					d_current = d + outbuf_offset;
-				}
-				if(
-					put_substitute(
-						internal->handle, internal->substitute, substitute_length, &d_current, &d_len)
-					< 0)
-				{
-					/* like E2BIG */
-					failed = true;
-					break;
-				}
-				skip_min_sequence(min_sequence_in_fromcode, &s_current, &s_len);
-			}else{
-				failed = true;
-				break;
-			}
-		}
-	}
-	if(!failed
-		&& iconv(internal->handle, NULL, NULL, &d_current, &d_len) == (size_t)-1)
-	{
-		failed = true;
+	CAMLparam1(val_pool);
+	struct pool_s *pool = pool_val(val_pool);
+	pthread_mutex_lock(&pool->mutex);
+	unsigned long hits = pool->hits;
+	pthread_mutex_unlock(&pool->mutex);
+	CAMLreturn(Val_long(hits));
+}
+
+CAMLprim value mliconv_pool_misses(value val_pool)
+{
+	CAMLparam1(val_pool);
+	struct pool_s *pool = pool_val(val_pool);
+	pthread_mutex_lock(&pool->mutex);
+	unsigned long misses = pool->misses;
+	pthread_mutex_unlock(&pool->mutex);
+	CAMLreturn(Val_long(misses));
+}
+
+/* statistics functions */
+
+/* All counters are 0 if SUPPORT_STATISTICS is not defined. */
+static value alloc_stats(uint64_t const *counters)
+{
+	CAMLparam0();
+	CAMLlocal1(val_result);
+	val_result = caml_alloc_small(STAT_COUNT, 0);
+	for(int i = 0; i < STAT_COUNT; ++ i){
+		Field(val_result, i) = Val_long(counters[i]);
 	}
-	if(failed){
-		iconv(internal->handle, NULL, NULL, NULL, NULL);
-		caml_failwith(__func__);
+	CAMLreturn(val_result);
+}
+
+CAMLprim value mliconv_stats_enabled(value val_unit)
+{
+	CAMLparam1(val_unit);
+#if defined(SUPPORT_STATISTICS)
+	CAMLreturn(Val_true);
+#else
+	CAMLreturn(Val_false);
+#endif
+}
+
+CAMLprim value mliconv_stats_snapshot(value val_conv)
+{
+	CAMLparam1(val_conv);
+	CAMLlocal1(val_result);
+#if defined(SUPPORT_STATISTICS)
+	struct stats_s stats = mliconv_val(val_conv)->stats;
+	val_result = alloc_stats(stats.counters);
+#else
+	uint64_t const counters[STAT_COUNT] = {0};
+	val_result = alloc_stats(counters);
+#endif
+	CAMLreturn(val_result);
+}
+
+CAMLprim value mliconv_stats_reset(value val_conv)
+{
+	CAMLparam1(val_conv);
+#if defined(SUPPORT_STATISTICS)
+	struct mliconv_t *internal = mliconv_val(val_conv);
+	memset(&internal->stats, 0, sizeof(internal->stats));
+#endif
+	CAMLreturn(Val_unit);
+}
+
+CAMLprim value mliconv_stats_global_snapshot(value val_unit)
+{
+	CAMLparam1(val_unit);
+	CAMLlocal1(val_result);
+#if defined(SUPPORT_STATISTICS)
+	uint64_t counters[STAT_COUNT];
+	for(int i = 0; i < STAT_COUNT; ++ i){
+		counters[i] = __atomic_load_n(&global_stats.counters[i], __ATOMIC_RELAXED);
 	}
-	size_t result_len = d_current - d;
-	val_result = caml_alloc_string(result_len);
-	d = (char *)Bytes_val(val_d); /* across OCaml allocation */
-	memcpy(Bytes_val(val_result), d, result_len);
+	val_result = alloc_stats(counters);
+#else
+	uint64_t const counters[STAT_COUNT] = {0};
+	val_result = alloc_stats(counters);
+#endif
 	CAMLreturn(val_result);
 }
 
+CAMLprim value mliconv_stats_global_reset(value val_unit)
+{
+	CAMLparam1(val_unit);
+#if defined(SUPPORT_STATISTICS)
+	for(int i = 0; i < STAT_COUNT; ++ i){
+		__atomic_store_n(&global_stats.counters[i], 0, __ATOMIC_RELAXED);
+	}
+#endif
+	CAMLreturn(Val_unit);
+}
+
 /* for pretty printer */
 
 CAMLprim value mliconv_tocode(value val_conv)